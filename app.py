@@ -7,10 +7,29 @@ import uuid
 import logging
 from datetime import datetime
 import hashlib
+import mimetypes
+import random
+import signal
+import threading
+import time
 
-from flask import Flask, request, jsonify
+from flask import Flask, request, jsonify, send_file, g
 from flask_cors import CORS
-from PIL import Image
+from werkzeug.wsgi import wrap_file
+import numpy as np
+from PIL import Image, features
+
+import face_pipeline
+import image_crypto
+import index_file
+import cancelable
+import config as server_config
+from audit_store import AuditSnapshotStore
+from storage_writer import StorageWriter
+from frame_gate import FrameGate
+from execution import RequestMeter, WorkStealingPool, parse_cpu_list, physical_core_count
+from face_index import Gallery, similarity
+from traffic_capture import TrafficRecorder, describe_image
 
 app = Flask(__name__)
 CORS(app)  # Enable CORS for cross-origin requests
@@ -22,12 +41,111 @@ logging.basicConfig(
 )
 logger = logging.getLogger(__name__)
 
+# Settings from config.toml and the environment (see config.py). Live
+# settings are re-applied to the module globals below on reload.
+config = server_config.Config()
+
 # Database configuration
-DATABASE = 'face_recognition.db'
-UPLOAD_FOLDER = 'uploaded_faces'
+DATABASE = config['server.database']
+UPLOAD_FOLDER = config['server.upload_folder']
+DERIVED_FOLDER = 'face_derivatives'
+
+# Admin UI derivatives of enrolled images: variant -> longest edge in pixels.
+# Source filenames are unique per upload, so derivatives never change and are
+# served with a one-year immutable cache lifetime.
+DERIVATIVE_SIZES = {'thumbnail': 160, 'crop': 112}
+DERIVATIVE_QUALITY = config['cache.derivative_quality']
+DERIVATIVE_MAX_AGE = 365 * 24 * 3600
+STORED_IMAGE_MAX_AGE = config['cache.stored_image_max_age']
+WEBP_SUPPORTED = features.check('webp')
+
+for folder in (UPLOAD_FOLDER, DERIVED_FOLDER):
+    if not os.path.exists(folder):
+        os.makedirs(folder)
+
+# AES-GCM encryption of stored images, enabled by FACE_ENCRYPTION_KEY
+if image_crypto.configure_from_env():
+    logger.info("Encryption at rest enabled for stored face images")
+
+# Cancelable templates (keyed binary codes instead of raw embeddings),
+# enabled by TEMPLATE_KEY. Templates are stored and matched per embedding
+# model and transform, so a new key or width starts a new template set.
+if cancelable.configure_from_env(config['templates.cancelable_bits']):
+    logger.info("Cancelable templates enabled")
+TEMPLATE_MODEL = (f"{face_pipeline.MODEL_NAME}/{cancelable.scheme()}" if cancelable.is_enabled()
+                  else face_pipeline.MODEL_NAME)
+
+# Recognition audit snapshots: probe images kept for disputed logins.
+# Every failed attempt is kept and AUDIT_SUCCESS_SAMPLE_RATE of successes.
+AUDIT_SNAPSHOTS = config['audit.enabled']
+AUDIT_FOLDER = 'audit_snapshots'
+AUDIT_SUCCESS_SAMPLE_RATE = config['audit.success_sample_rate']
+AUDIT_QUEUE_SIZE = config['audit.queue_size']
+AUDIT_MAX_BYTES = config['audit.max_mb'] * 1024 * 1024
+
+# Minimum cosine similarity, as a percentage, for a positive recognition
+RECOGNITION_THRESHOLD = config['recognition.threshold']
+
+# Open-set rejection: a match must also stand COHORT_Z_THRESHOLD standard
+# deviations above its template's impostor cohort. Templates without
+# cohort statistics yet (tiny galleries) fall back to the raw threshold.
+SCORE_NORMALIZATION = config['recognition.score_normalization']
+COHORT_Z_THRESHOLD = config['recognition.cohort_z_threshold']
 
-if not os.path.exists(UPLOAD_FOLDER):
-    os.makedirs(UPLOAD_FOLDER)
+# Enrolled templates of the active model, searched in memory. Large float
+# galleries can be scanned by coarse binary codes first (INDEX_COARSE_BITS),
+# or with INDEX_TYPE=ivf through an inverted-file index (see face_index.py). The gallery is saved
+# here on shutdown and reused at the next start.
+gallery = Gallery(coarse_bits=config['index.coarse_bits'])
+INDEX_TYPE = config['index.type']
+INDEX_IVF_LISTS = config['index.ivf_lists']
+GALLERY_SNAPSHOT = config['index.snapshot']
+
+# Each worker process holds its own gallery. Templates other processes
+# commit or delete (old workers finishing requests during a hot restart,
+# sibling workers) are picked up every GALLERY_SYNC_INTERVAL seconds;
+# gallery_synced_id is the highest template id this process has read, None
+# until the gallery is loaded.
+GALLERY_SYNC_INTERVAL = config['index.sync_interval']
+gallery_synced_id = None
+gallery_sync_lock = threading.Lock()
+
+# Template refresh (opt-in): confident matches teach the gallery how a user
+# looks now (glasses, haircut, aging). The enrollment template is always
+# kept; adaptive templates beyond the per-user cap replace the oldest one.
+TEMPLATE_UPDATE = config['templates.update']
+TEMPLATE_UPDATE_THRESHOLD = config['templates.update_threshold']
+TEMPLATE_REDUNDANT_SIMILARITY = 0.98
+MAX_TEMPLATES_PER_USER = config['templates.max_per_user']
+TEMPLATE_UPDATE_MAX_PENDING = 64
+
+template_updater = WorkStealingPool('template-update', 1)
+template_update_slots = threading.BoundedSemaphore(TEMPLATE_UPDATE_MAX_PENDING)
+
+# Execution model (see execution.py): detection, embedding and search run
+# on a fixed inference pool sized to the physical cores, optionally pinned
+# to INFERENCE_CPUS; HTTP request threads only do I/O. Intra-op threads are
+# the BLAS/TensorFlow threads inside a single inference call.
+INFERENCE_THREADS = config['inference.threads'] or physical_core_count()
+INFERENCE_CPUS = parse_cpu_list(config['inference.cpus'])
+INFERENCE_INTRA_OP_THREADS = config['inference.intra_op_threads']
+HTTP_THREADS = config['server.http_threads']
+
+face_pipeline.configure_threads(INFERENCE_INTRA_OP_THREADS, INFERENCE_THREADS)
+inference_pool = WorkStealingPool('inference', INFERENCE_THREADS, INFERENCE_CPUS)
+http_meter = RequestMeter(HTTP_THREADS)
+
+# Stored files are written atomically (see storage_writer.py); a batch size
+# above 0 moves the writes to a thread where concurrent enrollments share a
+# single flush instead of queueing on fsync
+storage_writer = StorageWriter(config['storage.fsync'], config['storage.batch_size'],
+                               config['storage.queue_size'])
+
+# Empty kiosk frames are answered from a thumbnail before the full decode
+# and the detector (see frame_gate.py); clients opt into the per-camera
+# motion check by sending a camera_id
+frame_gate = FrameGate(config['detection.frame_gate'], config['detection.frame_gate_threshold'],
+                       config['detection.frame_gate_max_age'])
 
 def init_database():
     """Initialize SQLite database with required tables"""
@@ -61,6 +179,35 @@ def init_database():
             )
         ''')
         
+        # Face templates (one user may own several)
+        cursor.execute('''
+            CREATE TABLE IF NOT EXISTS face_encodings (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                user_id INTEGER,
+                encoding_hash TEXT,
+                model_name TEXT DEFAULT 'VGG-Face',
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                embedding BLOB,
+                source TEXT DEFAULT 'enrollment',
+                cohort_mean REAL,
+                cohort_std REAL,
+                FOREIGN KEY (user_id) REFERENCES users(id)
+            )
+        ''')
+        
+        # Columns added after the first release
+        columns = {row[1] for row in cursor.execute('PRAGMA table_info(login_history)')}
+        if 'snapshot_path' not in columns:
+            cursor.execute('ALTER TABLE login_history ADD COLUMN snapshot_path TEXT')
+        columns = {row[1] for row in cursor.execute('PRAGMA table_info(face_encodings)')}
+        if 'embedding' not in columns:
+            cursor.execute('ALTER TABLE face_encodings ADD COLUMN embedding BLOB')
+        if 'source' not in columns:
+            cursor.execute("ALTER TABLE face_encodings ADD COLUMN source TEXT DEFAULT 'enrollment'")
+        if 'cohort_mean' not in columns:
+            cursor.execute('ALTER TABLE face_encodings ADD COLUMN cohort_mean REAL')
+            cursor.execute('ALTER TABLE face_encodings ADD COLUMN cohort_std REAL')
+        
         conn.commit()
         conn.close()
         logger.info("Database initialized successfully")
@@ -69,47 +216,783 @@ def init_database():
         logger.error(f"Failed to initialize database: {e}")
         return False
 
+def decode_base64_payload(base64_string):
+    """Decode a base64 image payload (optionally a data URL) to raw bytes"""
+    # Remove data URL prefix if present
+    if ',' in base64_string:
+        base64_string = base64_string.split(',')[1]
+    
+    return base64.b64decode(base64_string)
+
 def base64_to_image(base64_string):
     """Convert base64 string to PIL Image"""
     try:
-        # Remove data URL prefix if present
-        if ',' in base64_string:
-            base64_string = base64_string.split(',')[1]
-        
-        image_data = base64.b64decode(base64_string)
+        image_data = decode_base64_payload(base64_string)
         image = Image.open(io.BytesIO(image_data))
         return image
     except Exception as e:
         logger.error(f"Error converting base64 to image: {str(e)}")
         return None
 
-def save_image(image, user_id):
+def queue_stored_file(path, data, durable=True):
+    """Queue image bytes for the storage writer (encrypted when a key is
+    configured) and return a Future for the write. Durable writes are
+    flushed to disk; derivatives and audit snapshots skip that."""
+    if image_crypto.is_enabled():
+        return storage_writer.submit(path, image_crypto.encrypt_chunks(data), 0o600, durable)
+    return storage_writer.submit(path, [data], 0o644, durable)
+
+def write_stored_file(path, data, durable=True):
+    """Write image bytes to disk and wait until the file is in place"""
+    queue_stored_file(path, data, durable).result()
+
+def queue_image(image):
+    """Encode an enrollment image and queue its write. Returns (path,
+    Future); the write must succeed before a row references the path."""
+    filepath = os.path.join(UPLOAD_FOLDER, f"face_{uuid.uuid4().hex[:16]}.jpg")
+    
+    # Convert to RGB if necessary
+    if image.mode != 'RGB':
+        image = image.convert('RGB')
+    
+    buffer = io.BytesIO()
+    image.save(buffer, 'JPEG', quality=95)
+    return filepath, queue_stored_file(filepath, buffer.getvalue())
+
+def save_image(image):
     """Save image to disk and return file path"""
     try:
-        filename = f"user_{user_id}_{uuid.uuid4().hex[:8]}.jpg"
-        filepath = os.path.join(UPLOAD_FOLDER, filename)
-        
-        # Convert to RGB if necessary
-        if image.mode != 'RGB':
-            image = image.convert('RGB')
-        
-        image.save(filepath, 'JPEG', quality=95)
+        filepath, write = queue_image(image)
+        write.result()
         return filepath
     except Exception as e:
         logger.error(f"Error saving image: {str(e)}")
         return None
 
+def discard_image(path, write):
+    """Remove an image that will not be referenced, once its write is done"""
+    def remove(_):
+        if os.path.exists(path):
+            os.remove(path)
+    write.add_done_callback(remove)
+
+def encode_embedding(vector):
+    """Serialize a template (embedding or cancelable code) for
+    face_encodings.embedding, encrypted when a key is configured"""
+    vector = np.asarray(vector)
+    data = (vector if vector.dtype == np.uint8 else vector.astype('<f4')).tobytes()
+    return image_crypto.encrypt_bytes(data) if image_crypto.is_enabled() else data
+
+def decode_embedding(blob):
+    return np.frombuffer(image_crypto.decrypt_bytes(blob), dtype=np.uint8 if cancelable.is_enabled() else '<f4')
+
+def optional_float(value):
+    """NaN (statistics not available) is stored as NULL"""
+    return None if np.isnan(value) else float(value)
+
+def store_template(cursor, user_id, vector, source='enrollment', cohort_stats=None):
+    """Insert a face template row and return its id; `cohort_stats` is the
+    (mean, std) pair from gallery.cohort_stats_for()"""
+    mean, std = cohort_stats if cohort_stats is not None else (np.nan, np.nan)
+    cursor.execute('''
+        INSERT INTO face_encodings (user_id, encoding_hash, model_name, embedding, source, cohort_mean, cohort_std)
+        VALUES (?, ?, ?, ?, ?, ?, ?)
+    ''', (user_id, hashlib.md5(vector.tobytes()).hexdigest(), TEMPLATE_MODEL,
+          encode_embedding(vector), source, optional_float(mean), optional_float(std)))
+    return cursor.lastrowid
+
+def new_template_stats(user_id, vector):
+    """Cohort statistics of one new template as (mean, std), and as the
+    per-row arrays gallery.update() takes"""
+    means, stds = gallery.cohort_stats_for([vector], [user_id])
+    return (means[0], stds[0]), (means, stds)
+
+def fill_missing_cohort_stats():
+    """Compute cohort statistics for templates that have none, e.g. ones
+    enrolled while the gallery was too small for a usable cohort"""
+    try:
+        template_ids, user_ids, vectors = gallery.missing_cohort_stats()
+        if len(template_ids) == 0:
+            return
+        means, stds = gallery.cohort_stats_for(vectors, user_ids)
+        usable = ~np.isnan(stds)
+        if not usable.any():
+            return
+        
+        conn = sqlite3.connect(DATABASE)
+        conn.executemany(
+            'UPDATE face_encodings SET cohort_mean = ?, cohort_std = ? WHERE id = ?',
+            [(float(m), float(d), int(t)) for t, m, d in zip(template_ids[usable], means[usable], stds[usable])]
+        )
+        conn.commit()
+        conn.close()
+        gallery.set_cohort_stats(template_ids[usable], means[usable], stds[usable])
+        logger.info(f"Computed cohort statistics for {int(usable.sum())} templates")
+    except Exception as e:
+        logger.error(f"Error computing cohort statistics: {str(e)}")
+
+def load_gallery(use_snapshot=True):
+    """Load the active model's templates into memory, first embedding any
+    enrolled image that has no template for that model yet"""
+    global gallery_synced_id
+    conn = sqlite3.connect(DATABASE)
+    cursor = conn.cursor()
+    
+    cursor.execute('''
+        SELECT u.id, u.face_image_path FROM users u
+        WHERE u.face_image_path IS NOT NULL AND NOT EXISTS (
+            SELECT 1 FROM face_encodings f
+            WHERE f.user_id = u.id AND f.model_name = ? AND f.embedding IS NOT NULL
+        )
+    ''', (TEMPLATE_MODEL,))
+    for user_id, image_path in cursor.fetchall():
+        try:
+            image = Image.open(io.BytesIO(image_crypto.read_file(image_path)))
+            vector = embed_largest_face(image)
+            if vector is not None:
+                store_template(cursor, user_id, vector)
+        except Exception as e:
+            logger.warning(f"Could not embed enrolled image of user {user_id}: {e}")
+    if cancelable.is_enabled():
+        # Raw embeddings and codes under a revoked key are a liability once
+        # the user has a template under the current key
+        cursor.execute('''
+            DELETE FROM face_encodings
+            WHERE model_name != ? AND (model_name = ? OR model_name LIKE ?)
+              AND user_id IN (SELECT user_id FROM face_encodings WHERE model_name = ?)
+        ''', (TEMPLATE_MODEL, face_pipeline.MODEL_NAME, f"{face_pipeline.MODEL_NAME}/%", TEMPLATE_MODEL))
+        if cursor.rowcount:
+            logger.info(f"Deleted {cursor.rowcount} templates replaced by cancelable templates")
+    conn.commit()
+    
+    # Reuse the snapshot written at the last shutdown and decode only the
+    # templates added since; templates deleted or rewritten meanwhile are
+    # recognized by their id and hash and dropped from it
+    snapshot = read_gallery_snapshot(defer_vectors=True) if use_snapshot else None
+    cursor.execute('''
+        SELECT id, user_id, encoding_hash, cohort_mean, cohort_std FROM face_encodings
+        WHERE model_name = ? AND embedding IS NOT NULL
+        ORDER BY id
+    ''', (TEMPLATE_MODEL,))
+    rows = cursor.fetchall()
+    
+    template_ids = np.array([row[0] for row in rows], dtype=np.int64)
+    cached = np.zeros(len(rows), dtype=bool)
+    positions = np.zeros(len(rows), dtype=np.int64)
+    if snapshot is not None and len(snapshot['template_ids']):
+        order = np.argsort(snapshot['template_ids'])
+        found = np.minimum(np.searchsorted(snapshot['template_ids'], template_ids, sorter=order), len(order) - 1)
+        positions = order[found]
+        hashes = np.array([row[2] or '' for row in rows], dtype=str)
+        cached = (snapshot['template_ids'][positions] == template_ids) & (snapshot['hashes'][positions] == hashes)
+    
+    missing = template_ids[~cached].tolist()
+    decoded = {}
+    for start in range(0, len(missing), 500):
+        batch = missing[start:start + 500]
+        cursor.execute(f"SELECT id, embedding FROM face_encodings WHERE id IN ({','.join('?' * len(batch))})", batch)
+        decoded.update((template_id, decode_embedding(blob)) for template_id, blob in cursor.fetchall())
+    conn.close()
+    
+    if rows:
+        if cached.all() and len(rows) == len(snapshot['vectors']):
+            # Nothing changed since the snapshot: keep its row order so the
+            # gallery uses the mapped arrays as they are, without a copy
+            order = np.argsort(positions)
+            rows = [rows[index] for index in order]
+            template_ids, positions = template_ids[order], positions[order]
+            vectors, codes = snapshot['vectors'], snapshot['codes']
+        else:
+            vectors, codes = merge_snapshot_rows(snapshot, cached, positions, template_ids, decoded)
+        cohort_stats = (np.array([np.nan if row[3] is None else row[3] for row in rows], dtype=np.float32),
+                        np.array([np.nan if row[4] is None else row[4] for row in rows], dtype=np.float32))
+        gallery.load(template_ids, [row[1] for row in rows], vectors, cohort_stats, codes)
+        if INDEX_TYPE == 'ivf':
+            build_ivf_index(snapshot, cached, positions)
+        if cached.any() and snapshot.get('unverified') is not None:
+            threading.Thread(target=verify_gallery_snapshot, args=(snapshot['unverified'],),
+                             name='snapshot-verify', daemon=True).start()
+    gallery_synced_id = int(template_ids.max()) if len(template_ids) else 0
+    logger.info(f"Loaded {len(rows)} face templates ({TEMPLATE_MODEL}), "
+                f"{int(cached.sum())} from snapshot")
+    fill_missing_cohort_stats()
+
+def sync_gallery():
+    """Bring the gallery up to date with templates other processes have
+    committed or deleted since it was loaded. Returns (added, removed)."""
+    global gallery_synced_id
+    with gallery_sync_lock:
+        if gallery_synced_id is None:
+            return 0, 0
+        conn = sqlite3.connect(DATABASE)
+        try:
+            # One read transaction, so the new rows and the count agree
+            conn.execute('BEGIN')
+            rows = conn.execute('''
+                SELECT id, user_id, embedding, cohort_mean, cohort_std FROM face_encodings
+                WHERE id > ? AND model_name = ? AND embedding IS NOT NULL
+                ORDER BY id
+            ''', (gallery_synced_id, TEMPLATE_MODEL)).fetchall()
+            count, last_id = conn.execute('''
+                SELECT COUNT(*), MAX(id) FROM face_encodings
+                WHERE model_name = ? AND embedding IS NOT NULL
+            ''', (TEMPLATE_MODEL,)).fetchone()
+            last_id = last_id or 0
+            
+            # Template ids are never reused, so rows up to last_id that the
+            # gallery holds but the database does not were deleted elsewhere
+            held = gallery.snapshot().template_ids
+            held = held[held <= last_id]
+            new_ids = np.array([row[0] for row in rows], dtype=np.int64)
+            removed = np.zeros(0, dtype=np.int64)
+            if len(held) + int(np.count_nonzero(~np.isin(new_ids, held))) != count:
+                stored = np.array([row[0] for row in conn.execute(
+                    'SELECT id FROM face_encodings WHERE model_name = ? AND embedding IS NOT NULL',
+                    (TEMPLATE_MODEL,))], dtype=np.int64)
+                removed = held[~np.isin(held, stored)]
+        finally:
+            conn.close()
+        
+        if len(rows) or len(removed):
+            cohort_stats = (np.array([np.nan if row[3] is None else row[3] for row in rows], dtype=np.float32),
+                            np.array([np.nan if row[4] is None else row[4] for row in rows], dtype=np.float32))
+            before = len(gallery)
+            gallery.update(new_ids, [row[1] for row in rows],
+                           np.array([decode_embedding(row[2]) for row in rows]) if rows else None,
+                           cohort_stats, remove_template_ids=removed)
+            added = len(gallery) - before + len(removed)
+        else:
+            added = 0
+        gallery_synced_id = max(gallery_synced_id, last_id)
+    if added or len(removed):
+        logger.info(f"Synced gallery with the database: {added} templates added, {len(removed)} removed")
+        if added:
+            fill_missing_cohort_stats()
+    return added, len(removed)
+
+def sync_gallery_periodically():
+    while not _shut_down:
+        time.sleep(GALLERY_SYNC_INTERVAL if GALLERY_SYNC_INTERVAL > 0 else 1)
+        if GALLERY_SYNC_INTERVAL > 0 and not _shut_down:
+            try:
+                sync_gallery()
+            except Exception as e:
+                logger.error(f"Error syncing gallery: {str(e)}")
+
+def merge_snapshot_rows(snapshot, cached, positions, template_ids, decoded):
+    """Vectors and coarse codes of every row, copied from the snapshot
+    where cached and taken from `decoded` otherwise"""
+    if cached.any():
+        vectors = np.empty((len(cached), snapshot['vectors'].shape[1]), dtype=snapshot['vectors'].dtype)
+        vectors[cached] = snapshot['vectors'][positions[cached]]
+    else:
+        first = next(iter(decoded.values()))
+        vectors = np.empty((len(cached), len(first)), dtype=first.dtype)
+    for index in np.flatnonzero(~cached):
+        vectors[index] = decoded[int(template_ids[index])]
+    # Coarse codes of snapshot rows are reused; only new rows are encoded
+    codes = None
+    if cached.any() and snapshot['codes'] is not None:
+        codes = np.empty((len(cached), snapshot['codes'].shape[1]), dtype=np.uint8)
+        codes[cached] = snapshot['codes'][positions[cached]]
+        new_codes = gallery.coarse_codes(vectors[~cached])
+        if new_codes.shape[1] == codes.shape[1]:
+            codes[~cached] = new_codes
+        else:
+            codes = None
+    return vectors, codes
+
+def build_ivf_index(snapshot, cached, positions):
+    """Restore the IVF index saved with the snapshot, assigning only rows
+    added since, or cluster the gallery from scratch"""
+    started = time.perf_counter()
+    centroids = list_ids = None
+    if snapshot is not None and snapshot['centroids'] is not None:
+        centroids = snapshot['centroids']
+        list_ids = np.full(len(cached), -1, dtype=np.int32)
+        list_ids[cached] = snapshot['list_ids'][positions[cached]]
+    # Runs before serving, so clustering can use every inference thread
+    if not gallery.build_ivf(INDEX_IVF_LISTS, centroids, list_ids, pool=inference_pool):
+        logger.info("Gallery too small (or binary) for an IVF index; using the flat search")
+        return
+    lists = len(gallery.snapshot().centroids)
+    logger.info(f"IVF index with {lists} lists {'restored' if centroids is not None else 'trained'} "
+                f"in {time.perf_counter() - started:.1f}s")
+
+def read_gallery_snapshot(defer_vectors=False):
+    """Return the arrays of a saved gallery snapshot of the active model, or
+    None when there is no usable one. With `defer_vectors`, the vectors of a
+    mapped snapshot are returned before their checksum is checked, and
+    'unverified' holds the file for verify_gallery_snapshot()."""
+    if not GALLERY_SNAPSHOT or not os.path.exists(GALLERY_SNAPSHOT):
+        return None
+    try:
+        if image_crypto.is_encrypted_file(GALLERY_SNAPSHOT):
+            snapshot_file = index_file.IndexFile.from_buffer(image_crypto.read_file(GALLERY_SNAPSHOT))
+        else:
+            image_crypto.check_plaintext_file(GALLERY_SNAPSHOT)
+            snapshot_file = index_file.IndexFile.open(GALLERY_SNAPSHOT)
+        if snapshot_file.meta.get('model_name') != TEMPLATE_MODEL:
+            return None
+        snapshot = {key: snapshot_file.array(key) for key in ('template_ids', 'hashes')}
+        # Older snapshots have no coarse codes or IVF lists
+        for key in ('codes', 'list_ids', 'centroids'):
+            snapshot[key] = snapshot_file.get(key)
+        # Checking the vectors' CRC would read the whole mapped file, so at
+        # startup that is left to a background thread
+        deferred = defer_vectors and snapshot_file.mapped
+        snapshot['vectors'] = snapshot_file.array('vectors', verify=not deferred)
+        snapshot['unverified'] = snapshot_file if deferred else None
+        return snapshot
+    except Exception as e:
+        logger.warning(f"Ignoring unreadable gallery snapshot: {e}")
+        return None
+
+def verify_gallery_snapshot(snapshot_file):
+    """Check the checksum of the snapshot vectors the gallery started on;
+    if they are corrupt, reload every template from the database"""
+    try:
+        snapshot_file.array('vectors')
+    except index_file.IndexFormatError as e:
+        logger.error(f"Gallery snapshot is corrupt ({e}); reloading templates from the database")
+        with gallery_sync_lock:
+            load_gallery(use_snapshot=False)
+
+def snapshot_is_current(saved, arrays):
+    """Whether a saved snapshot already holds `arrays`. Vectors follow from
+    the template ids and hashes, so only their shape is compared."""
+    for key, array in arrays.items():
+        stored = saved.get(key)
+        if stored is None or array is None:
+            if stored is not array:
+                return False
+        elif key == 'vectors':
+            if stored.shape != array.shape or stored.dtype != array.dtype:
+                return False
+        elif not np.array_equal(stored, array):
+            return False
+    return True
+
+def save_gallery_snapshot():
+    """Write a full snapshot of the in-memory gallery so the next process
+    starts without decoding every template (encrypted when a key is
+    configured). Skipped when the snapshot on disk already matches."""
+    if not GALLERY_SNAPSHOT:
+        return
+    try:
+        snapshot = gallery.snapshot()
+        conn = sqlite3.connect(DATABASE)
+        hashes = dict(conn.execute(
+            'SELECT id, encoding_hash FROM face_encodings WHERE model_name = ?', (TEMPLATE_MODEL,)
+        ).fetchall())
+        conn.close()
+        
+        arrays = {
+            'template_ids': snapshot.template_ids,
+            'hashes': np.array([hashes.get(int(t), '') for t in snapshot.template_ids], dtype=str),
+            'vectors': snapshot.vectors,
+            'codes': snapshot.codes,
+            'list_ids': None if snapshot.centroids is None else snapshot.list_ids,
+            'centroids': snapshot.centroids
+        }
+        saved = read_gallery_snapshot()
+        if saved is not None and snapshot_is_current(saved, arrays):
+            logger.info(f"Gallery snapshot of {len(snapshot.template_ids)} templates is up to date")
+            return
+        arrays = {key: array for key, array in arrays.items() if array is not None}
+        blocks = index_file.encode(arrays, {'model_name': TEMPLATE_MODEL, 'templates': len(snapshot.template_ids)})
+        write_stored_file(GALLERY_SNAPSHOT, b''.join(blocks))
+        logger.info(f"Saved gallery snapshot of {len(snapshot.template_ids)} templates")
+    except Exception as e:
+        logger.error(f"Error saving gallery snapshot: {str(e)}")
+
+class FrameError(ValueError):
+    """A recognition request whose image or roi cannot be used"""
+
+def camera_of(data):
+    """Camera id a recognition request names, for per-camera state"""
+    camera_id = data.get('camera_id')
+    return None if camera_id is None else str(camera_id)
+
+def region_of(roi, size):
+    """(left, top, right, bottom) box of a request's roi within an image
+    of `size`, or None for no roi or one covering the whole frame"""
+    if roi is None:
+        return None
+    try:
+        left, top = int(roi['x']), int(roi['y'])
+        right, bottom = left + int(roi['width']), top + int(roi['height'])
+    except (TypeError, KeyError, ValueError):
+        raise FrameError('roi must be an object with x, y, width and height in pixels')
+    box = (max(left, 0), max(top, 0), min(right, size[0]), min(bottom, size[1]))
+    if box[2] <= box[0] or box[3] <= box[1]:
+        raise FrameError('roi does not overlap the image')
+    return None if box == (0, 0) + tuple(size) else box
+
+def read_frame(face_image_base64, roi, camera_id):
+    """Decode a recognition frame after the empty-frame gate has seen it.
+    Returns (image bytes, image, roi box or None, gate thumbnail, empty);
+    frames the gate answers as empty are not decoded further."""
+    try:
+        image_data = decode_base64_payload(face_image_base64)
+        image = Image.open(io.BytesIO(image_data))
+    except Exception:
+        raise FrameError('Invalid image format')
+    note_captured_image(image, face_image_base64)
+    region = region_of(roi, image.size)
+    thumbnail, empty_frame = frame_gate.screen(camera_id, image_data, region)
+    if not empty_frame:
+        try:
+            image.load()
+        except Exception:
+            raise FrameError('Invalid image format')
+    return image_data, image, region, thumbnail, empty_frame
+
+def identify_faces(image, largest_only=False, region=None):
+    """Run one detection pass over a decoded image (only its `region` box
+    when given), embed the faces (split across idle inference threads) and
+    search them as one batch. Returns (box, best Match or None, embedding)
+    per face, boxes in frame coordinates."""
+    if region is None:
+        boxes = face_pipeline.detect_faces(image)
+    else:
+        left, top = region[:2]
+        boxes = [(box[0] + left, box[1] + top, box[2] + left, box[3] + top)
+                 for box in face_pipeline.detect_faces(image.crop(region))]
+    if largest_only and boxes:
+        boxes = [face_pipeline.largest_face(boxes)]
+    if not boxes:
+        return []
+    
+    embeddings = embed_faces_in_parallel(image, boxes)
+    matches = gallery.search(embeddings, k=1)
+    return [(box, found[0] if found else None, embedding)
+            for box, found, embedding in zip(boxes, matches, embeddings)]
+
+def embed_templates(image, boxes):
+    """Embed face boxes as templates: the embeddings themselves, or their
+    cancelable codes when TEMPLATE_KEY is set (raw embeddings go no further)"""
+    embeddings = face_pipeline.embed_faces(image, boxes)
+    return cancelable.protect(embeddings) if cancelable.is_enabled() else embeddings
+
+def embed_faces_in_parallel(image, boxes):
+    """Embed the faces of one frame as up to one subtask per inference
+    thread; idle threads steal them, so a crowded frame does not run on a
+    single core. The search stays one batched matrix product."""
+    chunks = min(len(boxes), inference_pool.threads)
+    if chunks <= 1:
+        return embed_templates(image, boxes)
+    size = -(-len(boxes) // chunks)
+    futures = [inference_pool.submit(embed_templates, image, boxes[start:start + size])
+               for start in range(0, len(boxes), size)]
+    return np.concatenate(inference_pool.join(futures))
+
+def embed_largest_face(image):
+    """Template of the face closest to the camera, or None without a face"""
+    boxes = face_pipeline.detect_faces(image)
+    if not boxes:
+        return None
+    return embed_templates(image, [face_pipeline.largest_face(boxes)])[0]
+
+def confidence_of(match):
+    return round(match.score * 100, 2) if match else 0.0
+
+def z_score_of(match):
+    if match is None or np.isnan(match.z_score):
+        return None
+    return round(match.z_score, 2)
+
+def is_recognized(match):
+    if match is None or confidence_of(match) < RECOGNITION_THRESHOLD:
+        return False
+    if SCORE_NORMALIZATION and not np.isnan(match.z_score):
+        return match.z_score >= COHORT_Z_THRESHOLD
+    return True
+
+def maybe_refresh_template(match, embedding):
+    """Queue a template refresh for a confident match, if enabled. Runs on the
+    template-update thread so recognition never waits on it; refreshes are
+    skipped while too many are already pending."""
+    if not TEMPLATE_UPDATE or confidence_of(match) < TEMPLATE_UPDATE_THRESHOLD:
+        return
+    if not template_update_slots.acquire(blocking=False):
+        return
+    future = template_updater.submit(refresh_template, match.user_id, np.array(embedding))
+    future.add_done_callback(lambda _: template_update_slots.release())
+
+def refresh_template(user_id, embedding):
+    """Add the probe as an adaptive template of `user_id`, replacing the
+    oldest adaptive template once the user is at MAX_TEMPLATES_PER_USER"""
+    try:
+        template_ids, vectors = gallery.user_templates(user_id)
+        if len(vectors) and float(np.max(similarity(embedding[None], vectors))) >= TEMPLATE_REDUNDANT_SIMILARITY:
+            return  # Already well represented
+        
+        conn = sqlite3.connect(DATABASE)
+        cursor = conn.cursor()
+        cursor.execute('''
+            SELECT id FROM face_encodings
+            WHERE user_id = ? AND model_name = ? AND source = 'adaptive'
+            ORDER BY id
+        ''', (user_id, TEMPLATE_MODEL))
+        adaptive_ids = [row[0] for row in cursor.fetchall()]
+        
+        evicted = []
+        if len(template_ids) >= MAX_TEMPLATES_PER_USER:
+            if not adaptive_ids:
+                conn.close()
+                return  # Only enrollment templates; never replace those
+            evicted = adaptive_ids[:len(template_ids) - MAX_TEMPLATES_PER_USER + 1]
+            cursor.executemany('DELETE FROM face_encodings WHERE id = ?', [(i,) for i in evicted])
+        template_stats, cohort_stats = new_template_stats(user_id, embedding)
+        template_id = store_template(cursor, user_id, embedding, source='adaptive', cohort_stats=template_stats)
+        conn.commit()
+        conn.close()
+        
+        gallery.update([template_id], [user_id], [embedding], cohort_stats, remove_template_ids=evicted)
+        logger.info(f"Refreshed templates of user {user_id} (added {template_id}, replaced {evicted or 'none'})")
+    except Exception as e:
+        logger.error(f"Error refreshing template of user {user_id}: {str(e)}")
+
+def maybe_snapshot_probe(image_data, status):
+    """Queue the raw probe bytes for audit storage if this attempt is sampled.
+
+    Returns the snapshot path to record on the login_history row, or None
+    when auditing is off, the attempt is not sampled or the queue is full."""
+    if audit_store is None:
+        return None
+    if status == 'success' and random.random() >= AUDIT_SUCCESS_SAMPLE_RATE:
+        return None
+    try:
+        image_format = Image.open(io.BytesIO(image_data)).format or 'JPEG'
+    except Exception:
+        image_format = 'BIN'
+    extension = 'jpg' if image_format == 'JPEG' else image_format.lower()
+    return audit_store.submit(image_data, extension)
+
+def get_derivative(source_path, variant, image_format):
+    """Return the path of a cached thumbnail/crop, generating it on first use"""
+    stem = os.path.splitext(os.path.basename(source_path))[0]
+    extension = 'webp' if image_format == 'WEBP' else 'jpg'
+    path = os.path.join(DERIVED_FOLDER, f"{stem}_{variant}.{extension}")
+    # Derivatives cached before encryption was enabled are regenerated
+    if os.path.exists(path) and image_crypto.is_readable_file(path):
+        return path
+    
+    with Image.open(io.BytesIO(image_crypto.read_file(source_path))) as image:
+        image = image.convert('RGB')
+        if variant == 'crop':
+            boxes = inference_pool.run(face_pipeline.detect_faces, image)
+            box = face_pipeline.largest_face(boxes) if boxes else face_pipeline.face_crop_box(image)
+            image = image.crop(box)
+        size = DERIVATIVE_SIZES[variant]
+        image.thumbnail((size, size))
+        
+        buffer = io.BytesIO()
+        image.save(buffer, image_format, quality=DERIVATIVE_QUALITY)
+    # Derivatives are regenerated if lost, so skip the flush to disk
+    write_stored_file(path, buffer.getvalue(), durable=False)
+    return path
+
+def send_encrypted_file(path, max_age):
+    """Serve the plaintext of an encrypted file with the same conditional and
+    Range semantics as send_file. sendfile cannot apply here; instead the
+    seekable reader lets Range requests decrypt only the chunks they cover."""
+    stat = os.stat(path)
+    reader = image_crypto.DecryptingReader(path)
+    response = app.response_class(
+        reader,
+        mimetype=mimetypes.guess_type(path)[0] or 'application/octet-stream',
+        direct_passthrough=True
+    )
+    response.content_length = reader.size
+    response.last_modified = int(stat.st_mtime)
+    response.set_etag(f"{stat.st_mtime_ns:x}-{stat.st_size:x}")
+    response.cache_control.public = True
+    response.cache_control.max_age = max_age
+    response.call_on_close(reader.close)
+    return response.make_conditional(request, accept_ranges=True, complete_length=reader.size)
+
+def send_stored_file(path, max_age):
+    """Serve a file from disk with conditional, HEAD and single Range support.
+
+    send_file hands the open file to the server's wsgi.file_wrapper, which
+    production servers (gunicorn) turn into sendfile(2). Werkzeug answers
+    Range requests by slicing that file in Python, so 206 responses get a
+    fresh file_wrapper positioned at the range start instead: the server
+    then sends Content-Length bytes from that offset with sendfile too."""
+    path = os.path.abspath(path)
+    if image_crypto.is_encrypted_file(path):
+        return send_encrypted_file(path, max_age)
+    image_crypto.check_plaintext_file(path)
+    response = send_file(path, max_age=max_age, conditional=True)
+    
+    # Only servers that provide their own file_wrapper (and so honour
+    # Content-Length when sending) get the repositioned file
+    content_range = response.content_range
+    if (response.status_code == 206 and 'wsgi.file_wrapper' in request.environ
+            and content_range and content_range.start is not None):
+        response.response.close()
+        handle = open(path, 'rb')
+        handle.seek(content_range.start)
+        response.response = wrap_file(request.environ, handle)
+    return response
+
+def fetch_json_rows(cursor, query, params=()):
+    """Run a query whose only column is a json_object(...) built by SQLite
+    and return the rows joined into a JSON array string plus the row count.
+
+    SQLite's JSON1 writer serializes each row in C, so list endpoints never
+    build per-row Python dicts or go through jsonify."""
+    cursor.execute(query, params)
+    rows = [row[0] for row in cursor.fetchall()]
+    return '[' + ','.join(rows) + ']', len(rows)
+
+def json_list_response(key, items_json, count):
+    """Wrap a pre-serialized JSON array in the standard list envelope"""
+    body = f'{{"success":true,"{key}":{items_json},"count":{count}}}'
+    return app.response_class(body, mimetype='application/json')
+
+# Anonymized request capture for replay_traffic.py, enabled by CAPTURE_FILE
+CAPTURE_FILE = config['capture.file'] or None
+traffic_recorder = TrafficRecorder(CAPTURE_FILE, config['capture.key']) if CAPTURE_FILE else None
+if traffic_recorder is not None:
+    logger.info(f"Capturing anonymized traffic to {CAPTURE_FILE}")
+    if not config['capture.key']:
+        logger.warning("CAPTURE_KEY is not set: capture tokens are only stable within this worker process")
+
+@app.before_request
+def start_request_meter():
+    g.request_meter = http_meter.begin()
+
+@app.teardown_request
+def end_request_meter(error):
+    if 'request_meter' in g:
+        http_meter.end(g.pop('request_meter'), failed=error is not None)
+
+@app.before_request
+def start_capture_timer():
+    if traffic_recorder is not None:
+        g.capture_started = (time.time(), time.perf_counter())
+
+def note_captured_image(image, base64_string):
+    """Describe a request's face image for the traffic capture, from the
+    image the handler has already opened"""
+    if traffic_recorder is not None:
+        g.captured_image = describe_image(image, base64_string)
+
+@app.after_request
+def capture_request(response):
+    if traffic_recorder is not None and 'capture_started' in g:
+        started_at, started = g.capture_started
+        traffic_recorder.record(
+            started_at,
+            request.method,
+            request.url_rule.rule if request.url_rule else None,
+            request.path,
+            request.query_string.decode('latin-1'),
+            response.status_code,
+            (time.perf_counter() - started) * 1000,
+            request.get_json(silent=True) if request.is_json else None,
+            g.get('captured_image')
+        )
+    return response
+
+audit_store = None
+if AUDIT_SNAPSHOTS:
+    audit_store = AuditSnapshotStore(AUDIT_FOLDER, AUDIT_MAX_BYTES, AUDIT_QUEUE_SIZE,
+                                     lambda path, data: write_stored_file(path, data, durable=False))
+    logger.info(f"Audit snapshots enabled (success sample rate {AUDIT_SUCCESS_SAMPLE_RATE:.0%})")
+
+def apply_live_settings(values):
+    """Re-apply live settings (see config.py) after a reload"""
+    global RECOGNITION_THRESHOLD, SCORE_NORMALIZATION, COHORT_Z_THRESHOLD
+    global TEMPLATE_UPDATE, TEMPLATE_UPDATE_THRESHOLD, MAX_TEMPLATES_PER_USER
+    global AUDIT_SUCCESS_SAMPLE_RATE, AUDIT_MAX_BYTES, STORED_IMAGE_MAX_AGE, DERIVATIVE_QUALITY
+    global GALLERY_SYNC_INTERVAL
+    RECOGNITION_THRESHOLD = values['recognition.threshold']
+    SCORE_NORMALIZATION = values['recognition.score_normalization']
+    COHORT_Z_THRESHOLD = values['recognition.cohort_z_threshold']
+    TEMPLATE_UPDATE = values['templates.update']
+    TEMPLATE_UPDATE_THRESHOLD = values['templates.update_threshold']
+    MAX_TEMPLATES_PER_USER = values['templates.max_per_user']
+    AUDIT_SUCCESS_SAMPLE_RATE = values['audit.success_sample_rate']
+    AUDIT_MAX_BYTES = values['audit.max_mb'] * 1024 * 1024
+    STORED_IMAGE_MAX_AGE = values['cache.stored_image_max_age']
+    DERIVATIVE_QUALITY = values['cache.derivative_quality']
+    gallery.shortlist_factor = values['index.shortlist_factor']
+    gallery.cohort_size = values['index.cohort_size']
+    gallery.coarse_min_templates = values['index.coarse_min_templates']
+    gallery.coarse_candidates = values['index.coarse_candidates']
+    gallery.coarse_fraction = values['index.coarse_fraction']
+    gallery.ivf_nprobe_min = values['index.ivf_nprobe_min']
+    gallery.ivf_nprobe_max = values['index.ivf_nprobe_max']
+    gallery.ivf_margin = values['index.ivf_margin']
+    GALLERY_SYNC_INTERVAL = values['index.sync_interval']
+    frame_gate.enabled = values['detection.frame_gate']
+    frame_gate.motion_threshold = values['detection.frame_gate_threshold']
+    frame_gate.max_age = values['detection.frame_gate_max_age']
+    if audit_store is not None:
+        audit_store.max_bytes = AUDIT_MAX_BYTES
+
+config.subscribe(apply_live_settings)
+
+def reload_config_in_background(signum=None, frame=None):
+    # Signal handlers run between bytecodes of the main thread; keep file
+    # reads and listeners off it
+    threading.Thread(target=config.reload, name='config-reload', daemon=True).start()
+
+def install_reload_signals():
+    """Reload the config on SIGHUP, and on SIGUSR1 after gunicorn's own
+    handler (log reopening), since the gunicorn master forwards SIGUSR1 to
+    every worker"""
+    if threading.current_thread() is not threading.main_thread():
+        return
+    signal.signal(signal.SIGHUP, reload_config_in_background)
+    previous = signal.getsignal(signal.SIGUSR1)
+    if callable(previous):
+        def reload_after_previous(signum, frame):
+            previous(signum, frame)
+            reload_config_in_background()
+        signal.signal(signal.SIGUSR1, reload_after_previous)
+
+install_reload_signals()
+
 @app.route('/', methods=['GET'])
 def health_check():
     """Health check endpoint"""
     return jsonify({
         'status': 'healthy',
-        'service': 'Face Recognition Server (Simplified)',
+        'service': 'Face Recognition Server' if face_pipeline.DEEPFACE_AVAILABLE else 'Face Recognition Server (Simplified)',
         'version': '1.0.0',
-        'message': 'Server is running without DeepFace (for testing)',
+        'model': face_pipeline.MODEL_NAME,
+        'cancelable_templates': cancelable.is_enabled(),
+        'templates': len(gallery),
+        'message': 'Server is running' if face_pipeline.DEEPFACE_AVAILABLE else 'Server is running without DeepFace (for testing)',
         'timestamp': datetime.now().isoformat()
     })
 
+@app.route('/api/metrics', methods=['GET'])
+def get_metrics():
+    """Queue depth and CPU utilization per thread pool"""
+    try:
+        return jsonify({
+            'success': True,
+            'process_cpu_seconds': round(time.process_time(), 3),
+            'pools': {
+                'inference': inference_pool.stats(),
+                'http': http_meter.stats(),
+                'template_update': template_updater.stats()
+            },
+            'storage': storage_writer.stats(),
+            'index': gallery.index_stats(),
+            'frame_gate': frame_gate.stats(),
+            'intra_op_threads': INFERENCE_INTRA_OP_THREADS
+        })
+    except Exception as e:
+        logger.error(f"Error in get_metrics: {str(e)}")
+        return jsonify({'error': 'Internal server error'}), 500
+
 @app.route('/api/users/register', methods=['POST'])
 def register_user():
     """Register a new user with face image"""
@@ -131,32 +1014,55 @@ def register_user():
         image = base64_to_image(face_image_base64)
         if image is None:
             return jsonify({'error': 'Invalid image format'}), 400
+        note_captured_image(image, face_image_base64)
+        
+        # Start writing the face image now so the flush overlaps inference
+        image_path, image_write = queue_image(image)
+        
+        try:
+            embedding = inference_pool.run(embed_largest_face, image)
+        except Exception:
+            discard_image(image_path, image_write)
+            raise
+        if embedding is None:
+            discard_image(image_path, image_write)
+            return jsonify({'error': 'No face detected in image'}), 400
+        
+        # The user row may only reference an image that is on disk
+        try:
+            image_write.result()
+        except Exception as e:
+            logger.error(f"Error saving image: {str(e)}")
+            return jsonify({'error': 'Failed to save image'}), 500
         
         # Insert user into database
         conn = sqlite3.connect(DATABASE)
         cursor = conn.cursor()
         
-        cursor.execute('''
-            INSERT INTO users (name, department, email)
-            VALUES (?, ?, ?)
-        ''', (name, department, email))
-        
-        user_id = cursor.lastrowid
-        
-        # Save face image
-        image_path = save_image(image, user_id)
-        if image_path is None:
+        try:
+            cursor.execute('''
+                INSERT INTO users (name, department, email, face_image_path)
+                VALUES (?, ?, ?, ?)
+            ''', (name, department, email, image_path))
+            
+            user_id = cursor.lastrowid
+            
+            template_stats, cohort_stats = new_template_stats(user_id, embedding)
+            template_id = store_template(cursor, user_id, embedding, cohort_stats=template_stats)
+            
+            conn.commit()
+        except Exception:
             conn.rollback()
+            os.remove(image_path)
+            raise
+        finally:
             conn.close()
-            return jsonify({'error': 'Failed to save image'}), 500
         
-        # Update user with image path
-        cursor.execute('''
-            UPDATE users SET face_image_path = ? WHERE id = ?
-        ''', (image_path, user_id))
-        
-        conn.commit()
-        conn.close()
+        gallery.add([template_id], [user_id], [embedding], cohort_stats)
+        if np.isnan(gallery.snapshot().cohort_std).any():
+            # Templates enrolled while the gallery was too small for a cohort
+            # may have enough impostors now
+            template_updater.submit(fill_missing_cohort_stats)
         
         logger.info(f"User registered successfully: {name} (ID: {user_id})")
         
@@ -165,7 +1071,7 @@ def register_user():
             'user_id': user_id,
             'name': name,
             'department': department,
-            'message': 'User registered successfully (image saved, face recognition disabled)'
+            'message': 'User registered successfully'
         }), 201
         
     except Exception as e:
@@ -174,7 +1080,7 @@ def register_user():
 
 @app.route('/api/auth/recognize', methods=['POST'])
 def recognize_face():
-    """Simulate face recognition for testing"""
+    """Recognize the face closest to the camera"""
     try:
         data = request.get_json()
         
@@ -186,38 +1092,74 @@ def recognize_face():
         if not face_image_base64:
             return jsonify({'error': 'face_image is required'}), 400
         
-        # Get all registered users for simulation
-        conn = sqlite3.connect(DATABASE)
-        cursor = conn.cursor()
+        camera_id = camera_of(data)
+        try:
+            image_data, image, region, thumbnail, empty_frame = read_frame(
+                face_image_base64, data.get('roi'), camera_id)
+        except FrameError as e:
+            return jsonify({'error': str(e)}), 400
         
-        cursor.execute('''
-            SELECT id, name, department FROM users LIMIT 1
-        ''')
-        
-        user = cursor.fetchone()
-        
-        if not user:
-            conn.close()
+        if len(gallery) == 0:
             return jsonify({
                 'success': False,
                 'error': 'No registered users found'
             }), 404
         
-        # Simulate successful recognition for testing
-        user_id, name, department = user
-        confidence = 85.5  # Simulated confidence
+        # Frames the gate answers (flat, or a repeat of an empty scene whose
+        # first frame was recorded below) write no login history
+        if empty_frame:
+            return jsonify({
+                'success': False,
+                'error': 'No face detected',
+                'best_match_confidence': 0.0
+            })
+        
+        faces = inference_pool.run(identify_faces, image, largest_only=True, region=region)
+        frame_gate.observe(camera_id, thumbnail, bool(faces), region)
+        match = faces[0][1] if faces else None
+        confidence = confidence_of(match)
+        recognized = is_recognized(match)
+        status = 'success' if recognized else 'failed'
+        
+        conn = sqlite3.connect(DATABASE)
+        cursor = conn.cursor()
+        
+        user = None
+        if recognized:
+            cursor.execute('SELECT id, name, department FROM users WHERE id = ?', (match.user_id,))
+            user = cursor.fetchone()
         
         # Record login attempt
         client_ip = request.remote_addr
+        snapshot_path = maybe_snapshot_probe(image_data, status)
         cursor.execute('''
-            INSERT INTO login_history (user_id, action_type, status, confidence, ip_address)
-            VALUES (?, ?, ?, ?, ?)
-        ''', (user_id, 'login', 'success', confidence, client_ip))
+            INSERT INTO login_history (user_id, action_type, status, confidence, ip_address, snapshot_path)
+            VALUES (?, ?, ?, ?, ?, ?)
+        ''', (user[0] if user else None, 'login', status, confidence, client_ip, snapshot_path))
         
         conn.commit()
         conn.close()
         
-        logger.info(f"Face recognized (simulated): {name} ({confidence}%)")
+        if not faces:
+            logger.info("Recognition failed: no face detected")
+            return jsonify({
+                'success': False,
+                'error': 'No face detected',
+                'best_match_confidence': 0.0
+            })
+        
+        if not user:
+            logger.info(f"Face not recognized (best match {confidence}%)")
+            return jsonify({
+                'success': False,
+                'error': 'Face not recognized',
+                'best_match_confidence': confidence,
+                'z_score': z_score_of(match)
+            })
+        
+        user_id, name, department = user
+        logger.info(f"Face recognized: {name} ({confidence}%)")
+        maybe_refresh_template(match, faces[0][2])
         
         return jsonify({
             'success': True,
@@ -225,13 +1167,105 @@ def recognize_face():
             'user_name': name,
             'department': department,
             'confidence': confidence,
-            'message': 'Simulated recognition (DeepFace disabled for testing)'
+            'z_score': z_score_of(match)
         })
         
     except Exception as e:
         logger.error(f"Error in recognize_face: {str(e)}")
         return jsonify({'error': 'Internal server error', 'details': str(e)}), 500
 
+@app.route('/api/auth/recognize/multi', methods=['POST'])
+def recognize_faces_multi():
+    """Recognize every face in a frame (group entrances)"""
+    try:
+        data = request.get_json()
+        
+        if not data:
+            return jsonify({'error': 'No data provided'}), 400
+        
+        face_image_base64 = data.get('face_image')
+        
+        if not face_image_base64:
+            return jsonify({'error': 'face_image is required'}), 400
+        
+        camera_id = camera_of(data)
+        try:
+            image_data, image, region, thumbnail, empty_frame = read_frame(
+                face_image_base64, data.get('roi'), camera_id)
+        except FrameError as e:
+            return jsonify({'error': str(e)}), 400
+        
+        if len(gallery) == 0:
+            return jsonify({
+                'success': False,
+                'error': 'No registered users found'
+            }), 404
+        
+        if empty_frame:
+            return jsonify({'success': True, 'faces': [], 'count': 0, 'recognized_count': 0})
+        
+        # One decode, one detection pass, one embedding batch, one search
+        faces = inference_pool.run(identify_faces, image, region=region)
+        frame_gate.observe(camera_id, thumbnail, bool(faces), region)
+        
+        conn = sqlite3.connect(DATABASE)
+        cursor = conn.cursor()
+        
+        recognized_ids = sorted({match.user_id for _, match, _ in faces if is_recognized(match)})
+        users = {}
+        if recognized_ids:
+            placeholders = ','.join('?' * len(recognized_ids))
+            cursor.execute(f'SELECT id, name, department FROM users WHERE id IN ({placeholders})',
+                           recognized_ids)
+            users = {row[0]: row for row in cursor.fetchall()}
+        
+        results = []
+        for (left, top, right, bottom), match, embedding in faces:
+            user = users.get(match.user_id) if is_recognized(match) else None
+            if user:
+                maybe_refresh_template(match, embedding)
+            results.append({
+                'box': {'x': left, 'y': top, 'width': right - left, 'height': bottom - top},
+                'recognized': user is not None,
+                'user_id': user[0] if user else None,
+                'user_name': user[1] if user else None,
+                'department': user[2] if user else None,
+                'confidence': confidence_of(match),
+                'z_score': z_score_of(match)
+            })
+        
+        # One history row per face (a frame without faces still records one
+        # failed attempt), written in a single transaction. The frame's audit
+        # snapshot, if sampled, is shared by all of its rows.
+        all_recognized = bool(results) and all(face['recognized'] for face in results)
+        client_ip = request.remote_addr
+        snapshot_path = maybe_snapshot_probe(image_data, 'success' if all_recognized else 'failed')
+        attempts = [(face['user_id'], 'login', 'success' if face['recognized'] else 'failed',
+                     face['confidence'], client_ip, snapshot_path) for face in results]
+        if not attempts:
+            attempts = [(None, 'login', 'failed', 0.0, client_ip, snapshot_path)]
+        cursor.executemany('''
+            INSERT INTO login_history (user_id, action_type, status, confidence, ip_address, snapshot_path)
+            VALUES (?, ?, ?, ?, ?, ?)
+        ''', attempts)
+        
+        conn.commit()
+        conn.close()
+        
+        recognized_count = sum(face['recognized'] for face in results)
+        logger.info(f"Multi-face recognition: {recognized_count}/{len(results)} faces recognized")
+        
+        return jsonify({
+            'success': True,
+            'faces': results,
+            'count': len(results),
+            'recognized_count': recognized_count
+        })
+        
+    except Exception as e:
+        logger.error(f"Error in recognize_faces_multi: {str(e)}")
+        return jsonify({'error': 'Internal server error', 'details': str(e)}), 500
+
 @app.route('/api/users', methods=['GET'])
 def get_users():
     """Get all registered users"""
@@ -239,34 +1273,77 @@ def get_users():
         conn = sqlite3.connect(DATABASE)
         cursor = conn.cursor()
         
-        cursor.execute('''
-            SELECT id, name, department, email, created_at
+        users_json, count = fetch_json_rows(cursor, '''
+            SELECT json_object(
+                'id', id,
+                'name', name,
+                'department', department,
+                'email', email,
+                'created_at', created_at
+            )
             FROM users
             ORDER BY created_at DESC
         ''')
         
-        users = []
-        for row in cursor.fetchall():
-            users.append({
-                'id': row[0],
-                'name': row[1],
-                'department': row[2],
-                'email': row[3],
-                'created_at': row[4]
-            })
-        
         conn.close()
         
-        return jsonify({
-            'success': True,
-            'users': users,
-            'count': len(users)
-        })
+        return json_list_response('users', users_json, count)
         
     except Exception as e:
         logger.error(f"Error in get_users: {str(e)}")
         return jsonify({'error': 'Internal server error'}), 500
 
+@app.route('/api/users/<int:user_id>/face', methods=['GET'])
+def get_face_image(user_id):
+    """Serve a user's stored enrollment image (supports HEAD, Range and conditional GET)"""
+    try:
+        conn = sqlite3.connect(DATABASE)
+        cursor = conn.cursor()
+        cursor.execute('SELECT face_image_path FROM users WHERE id = ?', (user_id,))
+        row = cursor.fetchone()
+        conn.close()
+        
+        if not row or not row[0] or not os.path.exists(row[0]):
+            return jsonify({'error': 'Face image not found'}), 404
+        
+        return send_stored_file(row[0], STORED_IMAGE_MAX_AGE)
+        
+    except Exception as e:
+        logger.error(f"Error in get_face_image: {str(e)}")
+        return jsonify({'error': 'Internal server error'}), 500
+
+@app.route('/api/users/<int:user_id>/face/<variant>', methods=['GET'])
+def get_face_derivative(user_id, variant):
+    """Serve a cached thumbnail or face crop of a user's enrolled image"""
+    try:
+        if variant not in DERIVATIVE_SIZES:
+            return jsonify({'error': f'Unknown image variant: {variant}'}), 404
+        
+        conn = sqlite3.connect(DATABASE)
+        cursor = conn.cursor()
+        cursor.execute('SELECT face_image_path FROM users WHERE id = ?', (user_id,))
+        row = cursor.fetchone()
+        conn.close()
+        
+        if not row or not row[0] or not os.path.exists(row[0]):
+            return jsonify({'error': 'Face image not found'}), 404
+        
+        # Only hand out WebP to clients that explicitly ask for it
+        accepts_webp = any(mimetype == 'image/webp' and quality > 0
+                           for mimetype, quality in request.accept_mimetypes)
+        image_format = 'WEBP' if WEBP_SUPPORTED and accepts_webp else 'JPEG'
+        path = get_derivative(row[0], variant, image_format)
+        
+        response = send_stored_file(path, DERIVATIVE_MAX_AGE)
+        response.cache_control.public = True
+        response.cache_control.immutable = True
+        response.vary.add('Accept')
+        return response
+        
+    except Exception as e:
+        logger.error(f"Error in get_face_derivative: {str(e)}")
+        return jsonify({'error': 'Internal server error'}), 500
+
 @app.route('/api/history', methods=['GET'])
 def get_login_history():
     """Get login history"""
@@ -276,50 +1353,105 @@ def get_login_history():
         conn = sqlite3.connect(DATABASE)
         cursor = conn.cursor()
         
-        cursor.execute('''
-            SELECT h.id, h.user_id, u.name, h.action_type, h.status, 
-                   h.confidence, h.ip_address, h.created_at
+        history_json, count = fetch_json_rows(cursor, '''
+            SELECT json_object(
+                'id', h.id,
+                'user_id', h.user_id,
+                'user_name', COALESCE(u.name, 'Unknown'),
+                'action_type', h.action_type,
+                'status', h.status,
+                'confidence', h.confidence,
+                'ip_address', h.ip_address,
+                'created_at', h.created_at,
+                'has_snapshot', json(CASE WHEN h.snapshot_path IS NULL THEN 'false' ELSE 'true' END)
+            )
             FROM login_history h
             LEFT JOIN users u ON h.user_id = u.id
             ORDER BY h.created_at DESC
             LIMIT ?
         ''', (limit,))
         
-        history = []
-        for row in cursor.fetchall():
-            history.append({
-                'id': row[0],
-                'user_id': row[1],
-                'user_name': row[2] or 'Unknown',
-                'action_type': row[3],
-                'status': row[4],
-                'confidence': row[5],
-                'ip_address': row[6],
-                'created_at': row[7]
-            })
-        
         conn.close()
         
-        return jsonify({
-            'success': True,
-            'history': history,
-            'count': len(history)
-        })
+        return json_list_response('history', history_json, count)
         
     except Exception as e:
         logger.error(f"Error in get_login_history: {str(e)}")
         return jsonify({'error': 'Internal server error'}), 500
 
+@app.route('/api/history/<int:history_id>/snapshot', methods=['GET'])
+def get_history_snapshot(history_id):
+    """Serve the audit snapshot of the probe image for a login attempt"""
+    try:
+        conn = sqlite3.connect(DATABASE)
+        cursor = conn.cursor()
+        cursor.execute('SELECT snapshot_path FROM login_history WHERE id = ?', (history_id,))
+        row = cursor.fetchone()
+        conn.close()
+        
+        if not row or not row[0]:
+            return jsonify({'error': 'No snapshot recorded for this attempt'}), 404
+        if not os.path.exists(row[0]):
+            # Not written yet, dropped by the writer or evicted from the ring
+            return jsonify({'error': 'Snapshot is no longer available'}), 404
+        
+        return send_stored_file(row[0], STORED_IMAGE_MAX_AGE)
+        
+    except Exception as e:
+        logger.error(f"Error in get_history_snapshot: {str(e)}")
+        return jsonify({'error': 'Internal server error'}), 500
+
+def startup():
+    """Prepare the database and load the gallery; called once per server
+    process (see gunicorn.conf.py)"""
+    if not init_database():
+        return False
+    load_gallery()
+    threading.Thread(target=sync_gallery_periodically, name='gallery-sync', daemon=True).start()
+    logger.info(f"Face Recognition Server ready (model: {face_pipeline.MODEL_NAME})")
+    if not face_pipeline.DEEPFACE_AVAILABLE:
+        logger.info("Note: DeepFace is not installed; using the simplified pixel descriptor for testing")
+    return True
+
+_shutdown_lock = threading.Lock()
+_shut_down = False
+
+def shutdown(timeout=10):
+    """Drain background work once requests have stopped: pending template
+    refreshes, queued audit snapshots and the capture file, then save a
+    gallery snapshot if the one on disk is out of date"""
+    global _shut_down
+    with _shutdown_lock:
+        if _shut_down:
+            return
+        _shut_down = True
+    
+    template_updater.shutdown(wait=True)
+    inference_pool.shutdown(wait=True)
+    if audit_store is not None and not audit_store.flush(timeout):
+        logger.warning(f"{audit_store.pending()} audit snapshots were not written before shutdown")
+    if traffic_recorder is not None:
+        traffic_recorder.close()
+    save_gallery_snapshot()
+    storage_writer.close()
+    logger.info("Shutdown complete")
+
+def stop_dev_server(signum, frame):
+    # The development server exits its serve loop on KeyboardInterrupt
+    raise KeyboardInterrupt
+
 if __name__ == '__main__':
     # Initialize database
-    if not init_database():
+    if not startup():
         logger.error("Failed to initialize database. Exiting...")
         sys.exit(1)
     
     # Get port from environment variable (Railway uses this)
-    port = int(os.environ.get('PORT', 5000))
+    port = config['server.port']
     
-    logger.info(f"Starting Simplified Face Recognition Server on port {port}")
-    logger.info("Note: This version runs without DeepFace for testing purposes")
-    
-    app.run(host='0.0.0.0', port=port, debug=False) 
\ No newline at end of file
+    logger.info(f"Starting development server on port {port}; use gunicorn -c gunicorn.conf.py app:app in production")
+    signal.signal(signal.SIGTERM, stop_dev_server)
+    try:
+        app.run(host='0.0.0.0', port=port, debug=False)
+    finally:
+        shutdown()
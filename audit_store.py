@@ -0,0 +1,135 @@
+"""
+Bounded asynchronous storage for recognition audit snapshots
+
+Probe images are handed to a background writer through a bounded queue, so
+recognize requests never wait on disk. When the queue is full the snapshot
+is dropped instead of blocking. Stored snapshots form a ring: once their
+total size exceeds the byte cap, the oldest files are deleted.
+
+Every worker process of the server writes to the same folder, so the cap
+applies to the folder, not to one writer's files: each writer rescans the
+folder every RESCAN_SECONDS and evicts the oldest snapshots whoever wrote
+them. Between rescans the folder can exceed the cap by what the other
+workers wrote in that time.
+"""
+
+import collections
+import logging
+import os
+import queue
+import threading
+import time
+import uuid
+
+logger = logging.getLogger(__name__)
+
+# Seconds between rescans of the folder for other writers' snapshots
+RESCAN_SECONDS = 5.0
+# Temporary files older than this are left over from a crashed write;
+# younger ones may be another worker's write in progress
+STALE_TMP_SECONDS = 300
+
+
+class AuditSnapshotStore:
+    def __init__(self, folder, max_bytes, queue_size, write_file):
+        """`write_file(path, data)` performs the actual write, so snapshots
+        follow the same encryption-at-rest policy as enrolled images"""
+        self.folder = folder
+        self.max_bytes = max_bytes
+        self._write_file = write_file
+        self._queue = queue.Queue(maxsize=queue_size)
+        self._files = collections.deque()
+        self._total_bytes = 0
+        self._scanned = 0.0
+        self._lock = threading.Lock()
+        self.stats = {'written': 0, 'dropped': 0, 'evicted': 0, 'failed': 0}
+
+        if not os.path.exists(folder):
+            os.makedirs(folder)
+        self._scan()
+
+        self._thread = threading.Thread(target=self._run, name='audit-writer', daemon=True)
+        self._thread.start()
+
+    def _scan(self):
+        """Rebuild ring accounting from every snapshot in the folder: those
+        of a previous run and those other workers have written"""
+        entries = []
+        now = time.time()
+        for name in os.listdir(self.folder):
+            path = os.path.join(self.folder, name)
+            try:
+                stat = os.stat(path)
+                if name.endswith('.tmp'):
+                    if now - stat.st_mtime > STALE_TMP_SECONDS:
+                        os.remove(path)
+                    continue
+            except FileNotFoundError:
+                # Evicted by another worker meanwhile
+                continue
+            entries.append((stat.st_mtime, path, stat.st_size))
+        entries.sort()
+        self._files = collections.deque((path, size) for _, path, size in entries)
+        self._total_bytes = sum(size for _, _, size in entries)
+        self._scanned = time.monotonic()
+
+    def submit(self, data, extension='jpg'):
+        """Queue a snapshot for writing and return its path, or None if the
+        queue is full. The path is reserved up front so the caller can link
+        it to its login_history row straight away."""
+        path = os.path.join(self.folder, f"probe_{uuid.uuid4().hex}.{extension}")
+        try:
+            self._queue.put_nowait((path, data))
+        except queue.Full:
+            with self._lock:
+                self.stats['dropped'] += 1
+            return None
+        return path
+
+    def flush(self, timeout=None):
+        """Wait until every queued snapshot has been written"""
+        done = threading.Event()
+
+        def wait():
+            self._queue.join()
+            done.set()
+
+        threading.Thread(target=wait, daemon=True).start()
+        return done.wait(timeout)
+
+    def pending(self):
+        return self._queue.qsize()
+
+    def _run(self):
+        while True:
+            path, data = self._queue.get()
+            try:
+                self._write_file(path, data)
+                # The size on disk: with encryption at rest that is the
+                # plaintext plus the header and a tag per chunk
+                size = os.stat(path).st_size
+                with self._lock:
+                    self.stats['written'] += 1
+                self._files.append((path, size))
+                self._total_bytes += size
+                if time.monotonic() - self._scanned >= RESCAN_SECONDS:
+                    self._scan()
+                self._evict()
+            except Exception as e:
+                with self._lock:
+                    self.stats['failed'] += 1
+                logger.error(f"Failed to write audit snapshot {path}: {e}")
+            finally:
+                self._queue.task_done()
+
+    def _evict(self):
+        """Delete the oldest snapshots until the ring fits under max_bytes"""
+        while self._total_bytes > self.max_bytes and len(self._files) > 1:
+            path, size = self._files.popleft()
+            self._total_bytes -= size
+            try:
+                os.remove(path)
+            except FileNotFoundError:
+                pass
+            with self._lock:
+                self.stats['evicted'] += 1
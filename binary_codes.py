@@ -0,0 +1,96 @@
+"""
+Binary codes of face embeddings and Hamming search over them
+
+A code is the sign pattern of an embedding under a random projection
+(SimHash): bit i is set when the embedding lies on the positive side of
+hyperplane i. For unit vectors at angle theta, each bit differs with
+probability theta / pi, so the Hamming distance between two codes gives a
+cosine estimate, cos(pi * distance / bits).
+
+Codes are packed 8 bits per byte, with a width that is a multiple of 64
+so rows can be scanned as 64-bit words: XOR against the query, then
+popcount. numpy >= 2 has a native popcount (np.bitwise_count, POPCNT /
+VPOPCNTDQ where the CPU has it); older versions use a SWAR popcount done
+in place, block by block, to stay in cache.
+"""
+
+import numpy as np
+
+# Rows scanned per step, bounding temporary memory and keeping each block
+# in cache between the XOR and the popcount
+SCAN_BLOCK_ROWS = 16384
+
+_bitwise_count = getattr(np, 'bitwise_count', None)
+
+_M1 = np.uint64(0x5555555555555555)
+_M2 = np.uint64(0x3333333333333333)
+_M4 = np.uint64(0x0F0F0F0F0F0F0F0F)
+_H01 = np.uint64(0x0101010101010101)
+
+
+def projection(dim, bits, seed):
+    """Return a (dim, bits) float32 projection: orthonormal columns when
+    bits <= dim (distinct hyperplanes preserve angles best), Gaussian
+    otherwise. `seed` is anything np.random.default_rng() accepts."""
+    if bits % 64:
+        raise ValueError('Code width must be a multiple of 64 bits')
+    rng = np.random.default_rng(seed)
+    matrix = rng.standard_normal((dim, bits))
+    if bits <= dim:
+        matrix, _ = np.linalg.qr(matrix)
+    return np.ascontiguousarray(matrix, dtype=np.float32)
+
+
+def encode(vectors, matrix):
+    """Pack the signs of `vectors @ matrix` into (n, bits // 8) uint8 codes"""
+    vectors = np.asarray(vectors, dtype=np.float32).reshape(-1, matrix.shape[0])
+    codes = np.empty((len(vectors), matrix.shape[1] // 8), dtype=np.uint8)
+    for start in range(0, len(vectors), SCAN_BLOCK_ROWS):
+        block = slice(start, start + SCAN_BLOCK_ROWS)
+        codes[block] = np.packbits(vectors[block] @ matrix > 0, axis=1)
+    return codes
+
+
+def _popcount_rows(words):
+    """Set bits per row of a (n, w) uint64 array; `words` is overwritten"""
+    if _bitwise_count is not None:
+        return _bitwise_count(words).sum(axis=1, dtype=np.uint32)
+    shifted = words >> np.uint64(1)
+    shifted &= _M1
+    words -= shifted
+    np.right_shift(words, np.uint64(2), out=shifted)
+    shifted &= _M2
+    words &= _M2
+    words += shifted
+    np.right_shift(words, np.uint64(4), out=shifted)
+    words += shifted
+    words &= _M4
+    words *= _H01
+    words >>= np.uint64(56)
+    return words.sum(axis=1, dtype=np.uint32)
+
+
+def hamming(queries, codes):
+    """Return the (q, n) uint32 Hamming distances between packed codes"""
+    queries = np.ascontiguousarray(queries, dtype=np.uint8)
+    codes = np.ascontiguousarray(codes, dtype=np.uint8)
+    query_words = queries.reshape(len(queries), -1).view(np.uint64)
+    code_words = codes.reshape(len(codes), -1).view(np.uint64)
+    distances = np.empty((len(query_words), len(code_words)), dtype=np.uint32)
+    block = np.empty((min(SCAN_BLOCK_ROWS, len(code_words)), code_words.shape[1]), dtype=np.uint64)
+    for start in range(0, len(code_words), SCAN_BLOCK_ROWS):
+        rows = code_words[start:start + SCAN_BLOCK_ROWS]
+        for index, query in enumerate(query_words):
+            xor = np.bitwise_xor(rows, query, out=block[:len(rows)])
+            distances[index, start:start + len(rows)] = _popcount_rows(xor)
+    return distances
+
+
+def cosine(distances, bits):
+    """Cosine similarity estimated from Hamming distances of `bits`-bit codes"""
+    return np.cos(np.asarray(distances, dtype=np.float32) * np.float32(np.pi / bits))
+
+
+def similarity(queries, codes):
+    """Estimated cosine similarity between packed codes, shaped like a dot product"""
+    return cosine(hamming(queries, codes), np.asarray(codes).shape[-1] * 8)
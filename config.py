@@ -0,0 +1,187 @@
+"""
+Server configuration: built-in defaults, overridden by a TOML file,
+overridden by environment variables
+
+The file is FACE_SERVER_CONFIG (default: config.toml, optional); see
+config.example.toml for every setting. Live settings are re-read by
+reload() and take effect on the next request. The app reloads on SIGHUP,
+and under gunicorn on SIGUSR1 to the master, which forwards it to every
+worker. Other settings need a restart; a reload that changes one only logs
+a warning.
+"""
+
+import logging
+import os
+import threading
+import tomllib
+from collections import namedtuple
+
+logger = logging.getLogger(__name__)
+
+CONFIG_FILE = os.environ.get('FACE_SERVER_CONFIG', 'config.toml')
+
+Setting = namedtuple('Setting', ['key', 'env', 'type', 'default', 'live'])
+
+
+def parse_bool(value):
+    if isinstance(value, bool):
+        return value
+    text = str(value).strip().lower()
+    if text in ('1', 'true', 'yes', 'on'):
+        return True
+    if text in ('0', 'false', 'no', 'off'):
+        return False
+    raise ValueError(f"not a boolean: {value!r}")
+
+
+def choice(*options):
+    """Setting type accepting one of `options`"""
+    def parse(value):
+        text = str(value).strip().lower()
+        if text not in options:
+            raise ValueError(f"expected one of {', '.join(options)}: {value!r}")
+        return text
+    return parse
+
+
+index_type = choice('flat', 'ivf')
+
+
+SETTINGS = [
+    # key                                      env var                       type        default                 live
+    Setting('server.port',                     'PORT',                       int,        5000,                   False),
+    Setting('server.database',                 'DATABASE',                   str,        'face_recognition.db',  False),
+    Setting('server.upload_folder',            'UPLOAD_FOLDER',              str,        'uploaded_faces',       False),
+    Setting('server.http_threads',             'GUNICORN_THREADS',           int,        8,                      False),
+    Setting('server.graceful_timeout',         'GRACEFUL_TIMEOUT',           int,        30,                     False),
+    Setting('server.worker_timeout',           'WORKER_TIMEOUT',             int,        120,                    False),
+    Setting('server.keepalive',                'KEEPALIVE',                  int,        75,                     False),
+    Setting('server.worker_connections',       'WORKER_CONNECTIONS',         int,        4096,                   False),
+    Setting('recognition.threshold',           'RECOGNITION_THRESHOLD',      float,      60.0,                   True),
+    Setting('recognition.score_normalization', 'SCORE_NORMALIZATION',        parse_bool, True,                   True),
+    Setting('recognition.cohort_z_threshold',  'COHORT_Z_THRESHOLD',         float,      3.0,                    True),
+    Setting('templates.update',                'TEMPLATE_UPDATE',            parse_bool, False,                  True),
+    Setting('templates.update_threshold',      'TEMPLATE_UPDATE_THRESHOLD',  float,      90.0,                   True),
+    Setting('templates.max_per_user',          'MAX_TEMPLATES_PER_USER',     int,        5,                      True),
+    Setting('templates.cancelable_bits',       'TEMPLATE_BITS',              int,        512,                    False),
+    Setting('index.shortlist_factor',          'INDEX_SHORTLIST_FACTOR',     int,        4,                      True),
+    Setting('index.cohort_size',               'COHORT_SIZE',                int,        256,                    True),
+    Setting('index.coarse_bits',               'INDEX_COARSE_BITS',          int,        0,                      False),
+    Setting('index.coarse_min_templates',      'INDEX_COARSE_MIN_TEMPLATES', int,        100000,                 True),
+    Setting('index.coarse_candidates',         'INDEX_COARSE_CANDIDATES',    int,        1024,                   True),
+    Setting('index.coarse_fraction',           'INDEX_COARSE_FRACTION',      float,      0.03,                   True),
+    Setting('index.type',                      'INDEX_TYPE',                 index_type, 'flat',                 False),
+    Setting('index.ivf_lists',                 'INDEX_IVF_LISTS',            int,        0,                      False),
+    Setting('index.ivf_nprobe_min',            'INDEX_IVF_NPROBE_MIN',       int,        8,                      True),
+    Setting('index.ivf_nprobe_max',            'INDEX_IVF_NPROBE_MAX',       int,        64,                     True),
+    Setting('index.ivf_margin',                'INDEX_IVF_MARGIN',           float,      0.1,                    True),
+    Setting('index.snapshot',                  'GALLERY_SNAPSHOT',           str,        'gallery_snapshot.idx', False),
+    Setting('index.sync_interval',             'GALLERY_SYNC_INTERVAL',      float,      5.0,                    True),
+    Setting('detection.frame_gate',            'FRAME_GATE',                 parse_bool, True,                   True),
+    Setting('detection.frame_gate_threshold',  'FRAME_GATE_THRESHOLD',       float,      3.0,                    True),
+    Setting('detection.frame_gate_max_age',    'FRAME_GATE_MAX_AGE',         float,      10.0,                   True),
+    Setting('inference.threads',               'INFERENCE_THREADS',          int,        0,                      False),
+    Setting('inference.cpus',                  'INFERENCE_CPUS',             str,        '',                     False),
+    Setting('inference.intra_op_threads',      'INFERENCE_INTRA_OP_THREADS', int,        1,                      False),
+    Setting('audit.enabled',                   'AUDIT_SNAPSHOTS',            parse_bool, False,                  False),
+    Setting('audit.success_sample_rate',       'AUDIT_SUCCESS_SAMPLE_RATE',  float,      0.05,                   True),
+    Setting('audit.max_mb',                    'AUDIT_MAX_MB',               int,        512,                    True),
+    Setting('audit.queue_size',                'AUDIT_QUEUE_SIZE',           int,        256,                    False),
+    Setting('cache.stored_image_max_age',      'STORED_IMAGE_MAX_AGE',       int,        3600,                   True),
+    Setting('cache.derivative_quality',        'DERIVATIVE_QUALITY',         int,        80,                     True),
+    Setting('storage.fsync',                   'STORAGE_FSYNC',              parse_bool, True,                   False),
+    Setting('storage.batch_size',              'STORAGE_BATCH_SIZE',         int,        0,                      False),
+    Setting('storage.queue_size',              'STORAGE_QUEUE_SIZE',         int,        1024,                   False),
+    Setting('capture.file',                    'CAPTURE_FILE',               str,        '',                     False),
+    Setting('capture.key',                     'CAPTURE_KEY',                str,        '',                     False),
+]
+
+SETTINGS_BY_KEY = {setting.key: setting for setting in SETTINGS}
+
+
+def _flatten(table, prefix=''):
+    values = {}
+    for name, value in table.items():
+        key = f"{prefix}{name}"
+        if isinstance(value, dict):
+            values.update(_flatten(value, key + '.'))
+        else:
+            values[key] = value
+    return values
+
+
+def load(path=None):
+    """Resolve every setting; raises ValueError on a malformed file or value"""
+    path = path or CONFIG_FILE
+    file_values = {}
+    if path and os.path.exists(path):
+        try:
+            with open(path, 'rb') as f:
+                file_values = _flatten(tomllib.load(f))
+        except tomllib.TOMLDecodeError as e:
+            raise ValueError(f"{path}: {e}") from e
+        for key in file_values.keys() - SETTINGS_BY_KEY.keys():
+            logger.warning(f"{path}: unknown setting '{key}' ignored")
+
+    values = {}
+    for setting in SETTINGS:
+        raw, source = setting.default, 'default'
+        if setting.key in file_values:
+            raw, source = file_values[setting.key], path
+        if os.environ.get(setting.env) is not None:
+            raw, source = os.environ[setting.env], f"${setting.env}"
+        try:
+            values[setting.key] = setting.type(raw)
+        except (TypeError, ValueError) as e:
+            raise ValueError(f"{setting.key} (from {source}): {e}") from e
+    return values
+
+
+class Config:
+    """Current settings, swapped as a whole on reload so readers always see
+    a consistent set"""
+
+    def __init__(self, path=None):
+        self.path = path
+        self._values = load(path)
+        self._listeners = []
+        self._lock = threading.Lock()
+
+    def __getitem__(self, key):
+        return self._values[key]
+
+    def values(self):
+        return dict(self._values)
+
+    def subscribe(self, listener):
+        """Call `listener(values)` now and after every reload"""
+        self._listeners.append(listener)
+        listener(self._values)
+
+    def reload(self):
+        """Re-read the file and environment and apply live settings. Returns
+        the keys that changed; on an invalid config nothing changes."""
+        with self._lock:
+            try:
+                loaded = load(self.path)
+            except ValueError as e:
+                logger.error(f"Config reload failed, keeping current settings: {e}")
+                return []
+            values = dict(self._values)
+            changed = []
+            for key, value in loaded.items():
+                if value == values[key]:
+                    continue
+                if not SETTINGS_BY_KEY[key].live:
+                    logger.warning(f"Config: {key} changed to {value!r}; restart to apply")
+                    continue
+                values[key] = value
+                changed.append(key)
+            if not changed:
+                logger.info("Config reloaded, no live settings changed")
+                return []
+            self._values = values
+            for listener in self._listeners:
+                listener(values)
+            logger.info(f"Config reloaded: {', '.join(f'{key}={values[key]!r}' for key in changed)}")
+            return changed
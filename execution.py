@@ -0,0 +1,272 @@
+"""
+Execution model: which threads run what
+
+Inference (face detection, embedding and gallery search) runs on a fixed
+pool sized to the physical cores and optionally pinned to a CPU set, so it
+never oversubscribes the machine however many HTTP threads wait on it.
+HTTP request threads do the I/O: request parsing, SQLite and file
+serving. Each pool keeps counters for queue depth and CPU time; app.py
+exposes them at /api/metrics.
+"""
+
+import collections
+import logging
+import os
+import threading
+import time
+from concurrent.futures import FIRST_COMPLETED, Future, wait
+
+logger = logging.getLogger(__name__)
+
+
+def usable_cpus():
+    if hasattr(os, 'sched_getaffinity'):
+        return sorted(os.sched_getaffinity(0))
+    return list(range(os.cpu_count() or 1))
+
+
+def physical_core_count():
+    """Cores available to this process, counting SMT siblings once"""
+    cpus = set(usable_cpus())
+    cores = set()
+    for cpu in cpus:
+        path = f'/sys/devices/system/cpu/cpu{cpu}/topology/thread_siblings_list'
+        try:
+            with open(path) as f:
+                cores.add(f.read().strip())
+        except OSError:
+            return len(cpus)
+    return max(1, len(cores))
+
+
+def parse_cpu_list(text):
+    """Parse a Linux CPU list such as "0-3,6" into a set of CPU numbers"""
+    cpus = set()
+    for part in filter(None, (part.strip() for part in (text or '').split(','))):
+        if '-' in part:
+            first, last = part.split('-', 1)
+            cpus.update(range(int(first), int(last) + 1))
+        else:
+            cpus.add(int(part))
+    return cpus
+
+
+class _Meter:
+    """Busy wall time and CPU time of work done on a fixed number of threads"""
+
+    def __init__(self, threads):
+        self.threads = threads
+        self.started = time.monotonic()
+        self._lock = threading.Lock()
+        self.active = 0
+        self.completed = 0
+        self.failed = 0
+        self.busy_seconds = 0.0
+        self.cpu_seconds = 0.0
+
+    def begin(self, timed=True):
+        with self._lock:
+            self.active += 1
+        return (time.perf_counter(), time.thread_time()) if timed else None
+
+    def end(self, token, failed=False):
+        busy = cpu = 0.0
+        if token is not None:
+            started, cpu_started = token
+            busy = time.perf_counter() - started
+            cpu = time.thread_time() - cpu_started
+        with self._lock:
+            self.active -= 1
+            self.completed += 1
+            self.failed += failed
+            self.busy_seconds += busy
+            self.cpu_seconds += cpu
+
+    def stats(self):
+        capacity = max(time.monotonic() - self.started, 1e-9) * self.threads
+        with self._lock:
+            return {
+                'threads': self.threads,
+                'active': self.active,
+                'completed': self.completed,
+                'failed': self.failed,
+                'busy_utilization': round(self.busy_seconds / capacity, 4),
+                'cpu_utilization': round(self.cpu_seconds / capacity, 4),
+                'cpu_seconds': round(self.cpu_seconds, 3)
+            }
+
+
+class _Task:
+    __slots__ = ('fn', 'args', 'kwargs', 'future', 'submitted')
+
+    def __init__(self, fn, args, kwargs):
+        self.fn = fn
+        self.args = args
+        self.kwargs = kwargs
+        self.future = Future()
+        self.submitted = time.perf_counter()
+
+
+class WorkStealingPool:
+    """Fixed-size work-stealing thread pool with queue and CPU counters.
+
+    Tasks submitted from outside go to a shared injection queue. Tasks
+    submitted by a task (per-face subtasks of one frame) go to the
+    submitting worker's own deque: the owner takes its newest task first,
+    while idle workers steal the oldest, so a large multi-face frame
+    spreads over every idle thread instead of running on one. A worker
+    steals before it starts a new request from the injection queue, so
+    frames already in progress finish first under load. join() lets
+    a worker run queued subtasks while it waits, so forking and joining
+    inside the pool cannot deadlock it.
+
+    `cpus` pins every worker thread to that CPU set (Linux only)."""
+
+    def __init__(self, name, threads, cpus=None):
+        self.name = name
+        self.threads = threads
+        self.cpus = set(cpus or ())
+        self._meter = _Meter(threads)
+        self._condition = threading.Condition()
+        self._injected = collections.deque()
+        self._deques = [collections.deque() for _ in range(threads)]
+        self._local = threading.local()
+        self._queued = 0
+        self._queue_wait_seconds = 0.0
+        self._stolen = 0
+        self._shutdown = False
+        self._workers = [threading.Thread(target=self._work, args=(index,), name=f'{name}_{index}', daemon=True)
+                         for index in range(threads)]
+        for worker in self._workers:
+            worker.start()
+
+    def _pin_thread(self):
+        if not self.cpus:
+            return
+        try:
+            os.sched_setaffinity(0, self.cpus)  # 0 is the calling thread on Linux
+        except (AttributeError, OSError) as e:
+            logger.warning(f"Could not pin {self.name} thread to CPUs {sorted(self.cpus)}: {e}")
+
+    def submit(self, fn, *args, **kwargs):
+        task = _Task(fn, args, kwargs)
+        index = getattr(self._local, 'index', None)
+        with self._condition:
+            if self._shutdown:
+                raise RuntimeError('cannot schedule new tasks after shutdown')
+            (self._injected if index is None else self._deques[index]).append(task)
+            self._queued += 1
+            self._condition.notify()
+        return task.future
+
+    def run(self, fn, *args, **kwargs):
+        """Run `fn` on the pool and wait for its result"""
+        return self.join([self.submit(fn, *args, **kwargs)])[0]
+
+    def join(self, futures):
+        """Wait for `futures` and return their results in order. On a worker
+        thread, queued subtasks are run while waiting instead of blocking;
+        new requests from the injection queue are left to idle workers."""
+        futures = list(futures)
+        index = getattr(self._local, 'index', None)
+        if index is not None:
+            pending = [future for future in futures if not future.done()]
+            while pending:
+                with self._condition:
+                    task = self._take(index, injected=False)
+                if task is not None:
+                    self._run(task)
+                else:
+                    wait(pending, timeout=0.005, return_when=FIRST_COMPLETED)
+                pending = [future for future in pending if not future.done()]
+        return [future.result() for future in futures]
+
+    def shutdown(self, wait=True):
+        """Stop accepting tasks; workers exit once every queued task has run"""
+        with self._condition:
+            self._shutdown = True
+            self._condition.notify_all()
+        if wait:
+            for worker in self._workers:
+                if worker is not threading.current_thread():
+                    worker.join()
+
+    def _take(self, index, injected=True):
+        """Dequeue the next task for worker `index`; the lock must be held"""
+        stolen = False
+        task = None
+        if self._deques[index]:
+            task = self._deques[index].pop()
+        else:
+            for offset in range(1, self.threads):
+                victim = self._deques[(index + offset) % self.threads]
+                if victim:
+                    task = victim.popleft()
+                    stolen = True
+                    break
+        if task is None:
+            if not (injected and self._injected):
+                return None
+            task = self._injected.popleft()
+        self._queued -= 1
+        self._queue_wait_seconds += time.perf_counter() - task.submitted
+        self._stolen += stolen
+        return task
+
+    def _run(self, task):
+        if not task.future.set_running_or_notify_cancel():
+            return
+        # A subtask run inside join() is already timed by its parent
+        nested = getattr(self._local, 'running', False)
+        self._local.running = True
+        token = self._meter.begin(timed=not nested)
+        try:
+            result = task.fn(*task.args, **task.kwargs)
+        except BaseException as e:
+            self._meter.end(token, failed=True)
+            task.future.set_exception(e)
+        else:
+            self._meter.end(token)
+            task.future.set_result(result)
+        finally:
+            self._local.running = nested
+
+    def _work(self, index):
+        self._local.index = index
+        self._pin_thread()
+        while True:
+            with self._condition:
+                task = self._take(index)
+                while task is None:
+                    if self._shutdown:
+                        return
+                    self._condition.wait()
+                    task = self._take(index)
+            self._run(task)
+
+    def stats(self):
+        stats = self._meter.stats()
+        with self._condition:
+            stats['queued'] = self._queued
+            stats['stolen'] = self._stolen
+            stats['avg_queue_wait_ms'] = round(
+                self._queue_wait_seconds * 1000 / max(stats['completed'] + stats['active'], 1), 3)
+        stats['cpus'] = sorted(self.cpus) or None
+        return stats
+
+
+class RequestMeter:
+    """Counters for threads the server owns, such as gunicorn's request
+    threads: call begin() when a request starts and end() when it is done"""
+
+    def __init__(self, threads):
+        self._meter = _Meter(threads)
+
+    def begin(self):
+        return self._meter.begin()
+
+    def end(self, token, failed=False):
+        self._meter.end(token, failed)
+
+    def stats(self):
+        return self._meter.stats()
@@ -0,0 +1,544 @@
+"""
+In-memory gallery of enrolled face templates
+
+Templates are L2-normalized float32 rows, so a search is one matrix product
+of the probe batch against the gallery. Cancelable templates (see
+cancelable.py) are packed uint8 binary codes instead, scored by Hamming
+distance turned into a cosine estimate; everything else is the same. A
+user may own several templates; results are aggregated to the
+best-scoring template per user.
+
+Large float galleries can also keep a short binary code per template
+(random-projection signs, see binary_codes.py). A search then scans the
+codes by Hamming distance first and scores only the closest candidates
+with the exact float product; below `coarse_min_templates` templates the
+exact scan is cheap enough on its own. The candidates are a share of the
+gallery per requested match, since the codes rank near neighbours only
+roughly. Alternatively a float gallery can
+be clustered into an inverted-file index (see ivf.py). Training groups the
+rows by list so every posting list is one contiguous block of memory;
+templates added later are appended and only the posting lists (row
+numbers per list) are updated.
+
+Each template also carries cohort statistics: the mean and standard
+deviation of its similarity to templates of other users. Raw scores of
+shortlisted candidates are turned into Z-scores with them, which keeps
+open-set rejection stable as the gallery (and so the number of impostors
+near any fixed raw threshold) grows.
+
+Updates are copy-on-write: writers build new arrays under a lock and
+publish them with a single reference swap, so searches read a consistent
+snapshot and never wait on enrollment. Appends are the exception: row
+arrays keep spare capacity, and new rows are written past the end that
+published snapshots can see, so an enrollment does not copy the gallery.
+
+Rows refer to their user by a dense 32-bit slot (see id_map.py), not by
+users.id; results are mapped back to user ids.
+"""
+
+import threading
+from collections import namedtuple
+
+import numpy as np
+
+import binary_codes
+import id_map
+import ivf
+
+# `user_slots` are the dense slots of the rows' users in `users` (an
+# id_map.IdMap); `codes` are the coarse binary codes of `vectors`, (n, 0)
+# when disabled; `list_ids` the IVF list of every row (-1 without an IVF
+# index), `centroids` the IVF centroids and `postings` their posting lists
+# as ivf.layout() returns them, or None
+GallerySnapshot = namedtuple('GallerySnapshot', [
+    'vectors', 'template_ids', 'user_slots', 'cohort_mean', 'cohort_std', 'codes',
+    'list_ids', 'centroids', 'users', 'postings'
+])
+# Fields holding one entry per template
+ROW_FIELDS = ('vectors', 'template_ids', 'user_slots', 'cohort_mean', 'cohort_std', 'codes', 'list_ids')
+
+# z_score is NaN when the template has no cohort statistics yet
+Match = namedtuple('Match', ['user_id', 'template_id', 'score', 'z_score'])
+
+# Impostor templates sampled per template for cohort statistics, and the
+# fewest that still give a usable estimate
+COHORT_SIZE = 256
+COHORT_MIN_SIZE = 16
+# Floor on the cohort deviation so near-duplicate cohorts cannot blow up Z
+COHORT_MIN_STD = 1e-3
+# Share of freed user slots above which slots are renumbered
+USER_SLOTS_MAX_FREE = 0.25
+# Spare rows reserved when a row array is reallocated for appends, as a
+# share of its new length, and at least
+APPEND_HEADROOM = 0.25
+APPEND_MIN_CAPACITY = 1024
+# Rows scored against the cohort per step, bounding temporary memory
+COHORT_BLOCK_ROWS = 16384
+# Fixed seed of the coarse code projection; codes only shortlist, so the
+# projection need not be secret
+COARSE_SEED = 0x5EED
+
+
+def similarity(queries, templates):
+    """Cosine similarity of every query row against every template row, for
+    float embeddings and binary codes alike"""
+    if templates.dtype == np.uint8:
+        return binary_codes.similarity(queries, templates)
+    return queries @ templates.T
+
+
+def as_templates(vectors):
+    """Contiguous template rows: binary codes stay uint8, embeddings float32"""
+    vectors = np.asarray(vectors)
+    return np.ascontiguousarray(vectors, dtype=np.uint8 if vectors.dtype == np.uint8 else np.float32)
+
+
+def _empty_snapshot(dim, dtype=np.float32, code_bytes=0):
+    return GallerySnapshot(
+        np.zeros((0, dim), dtype=dtype),
+        np.zeros(0, dtype=np.int64),
+        np.zeros(0, dtype=np.int32),
+        np.zeros(0, dtype=np.float32),
+        np.zeros(0, dtype=np.float32),
+        np.zeros((0, code_bytes), dtype=np.uint8),
+        np.zeros(0, dtype=np.int32),
+        None,
+        id_map.IdMap(),
+        None
+    )
+
+
+def _take_rows(snapshot, rows):
+    """Snapshot restricted to `rows` (a mask or index array), in that order;
+    the caller rebuilds its posting lists"""
+    return snapshot._replace(postings=None, **{field: getattr(snapshot, field)[rows] for field in ROW_FIELDS})
+
+
+def _carried_list_ids(built, current):
+    """List ids of `current`'s rows taken from the same template ids in
+    `built`, -1 for rows `built` does not have"""
+    list_ids = np.full(len(current.template_ids), -1, dtype=np.int32)
+    if len(built.template_ids) == 0:
+        return list_ids
+    order = np.argsort(built.template_ids)
+    positions = order[np.minimum(np.searchsorted(built.template_ids, current.template_ids, sorter=order),
+                                 len(order) - 1)]
+    found = built.template_ids[positions] == current.template_ids
+    list_ids[found] = built.list_ids[positions[found]]
+    return list_ids
+
+
+def _missing_stats(count):
+    return np.full(count, np.nan, dtype=np.float32), np.full(count, np.nan, dtype=np.float32)
+
+
+def cohort_statistics(vectors, user_ids, cohort_vectors, cohort_user_ids):
+    """Return (means, stds) of each row's similarity to the cohort templates
+    that belong to other users; NaN where fewer than COHORT_MIN_SIZE remain"""
+    means, stds = _missing_stats(len(vectors))
+    for start in range(0, len(vectors), COHORT_BLOCK_ROWS):
+        block = slice(start, start + COHORT_BLOCK_ROWS)
+        scores = similarity(vectors[block], cohort_vectors)
+        impostor = user_ids[block, None] != cohort_user_ids[None, :]
+        counts = impostor.sum(axis=1)
+        safe_counts = np.maximum(counts, 1)
+        block_means = np.where(impostor, scores, 0).sum(axis=1) / safe_counts
+        block_vars = np.where(impostor, (scores - block_means[:, None]) ** 2, 0).sum(axis=1) / safe_counts
+        usable = counts >= COHORT_MIN_SIZE
+        means[block] = np.where(usable, block_means, np.nan)
+        stds[block] = np.where(usable, np.maximum(np.sqrt(block_vars), COHORT_MIN_STD), np.nan)
+    return means, stds
+
+
+class Gallery:
+    def __init__(self, dim=0, shortlist_factor=4, cohort_size=COHORT_SIZE,
+                 coarse_bits=0, coarse_min_templates=100000, coarse_candidates=1024,
+                 coarse_fraction=0.03,
+                 ivf_nprobe_min=8, ivf_nprobe_max=64, ivf_margin=0.1):
+        self._snapshot = _empty_snapshot(dim)
+        self._write_lock = threading.Lock()
+        # Candidates shortlisted per requested match, and impostor templates
+        # sampled for cohort statistics; both may be tuned while serving
+        self.shortlist_factor = shortlist_factor
+        self.cohort_size = cohort_size
+        # Coarse codes are kept for float galleries when coarse_bits > 0, and
+        # used once the gallery reaches coarse_min_templates; the closest
+        # coarse_fraction of the gallery per requested match, at least
+        # coarse_candidates rows, are re-scored exactly
+        self.coarse_bits = coarse_bits
+        self.coarse_min_templates = coarse_min_templates
+        self.coarse_candidates = coarse_candidates
+        self.coarse_fraction = coarse_fraction
+        self._projections = {}
+        # IVF lists probed per query (see ivf.probe_lists)
+        self.ivf_nprobe_min = ivf_nprobe_min
+        self.ivf_nprobe_max = ivf_nprobe_max
+        self.ivf_margin = ivf_margin
+        # Row arrays with spare capacity, by field: (buffer, published view)
+        self._buffers = {}
+        self._stats_lock = threading.Lock()
+        self._searches = 0
+        self._lists_probed = 0
+        self._rows_scored = 0
+
+    def __len__(self):
+        return len(self._snapshot.template_ids)
+
+    @property
+    def dim(self):
+        return self._snapshot.vectors.shape[1]
+
+    def user_count(self):
+        return len(self._snapshot.users)
+
+    def snapshot(self):
+        return self._snapshot
+
+    def _code_bytes(self, vectors):
+        return 0 if vectors.dtype == np.uint8 else self.coarse_bits // 8
+
+    def coarse_codes(self, vectors):
+        """Coarse codes of new template rows; (n, 0) for binary templates or
+        when coarse search is off"""
+        if not self._code_bytes(vectors):
+            return np.zeros((len(vectors), 0), dtype=np.uint8)
+        dim = vectors.shape[1]
+        if dim not in self._projections:
+            self._projections[dim] = binary_codes.projection(dim, self.coarse_bits, COARSE_SEED)
+        return binary_codes.encode(vectors, self._projections[dim])
+
+    def load(self, template_ids, user_ids, vectors, cohort_stats=None, codes=None):
+        """Replace the whole gallery (startup or rebuild); `codes` are coarse
+        codes saved from an earlier snapshot, recomputed when their width
+        does not match"""
+        vectors = as_templates(vectors)
+        means, stds = cohort_stats if cohort_stats is not None else _missing_stats(len(vectors))
+        if codes is None or np.shape(codes) != (len(vectors), self._code_bytes(vectors)):
+            codes = self.coarse_codes(vectors)
+        users, user_slots = id_map.IdMap.build(user_ids)
+        with self._write_lock:
+            self._buffers = {}
+            self._snapshot = GallerySnapshot(
+                vectors,
+                np.asarray(template_ids, dtype=np.int64),
+                user_slots,
+                np.asarray(means, dtype=np.float32),
+                np.asarray(stds, dtype=np.float32),
+                codes,
+                np.full(len(vectors), -1, dtype=np.int32),
+                None,
+                users,
+                None
+            )
+
+    def build_ivf(self, lists=0, centroids=None, list_ids=None, seed=0, pool=None):
+        """Cluster the gallery into an IVF index with `lists` lists (0: about
+        sqrt of the gallery size), or restore one from an earlier snapshot:
+        `centroids` with the `list_ids` of the current rows, -1 where a row
+        still has to be assigned. Freshly trained rows are regrouped so
+        that each list is contiguous; restored rows keep their order (and
+        their memory mapping). Training and assignment run on `pool` when
+        given, without holding the write lock: the index is built from the
+        snapshot current at the call, and templates added or removed
+        meanwhile are accounted for when it is published.
+        Returns False, leaving the gallery unindexed, for binary galleries
+        and galleries too small to cluster."""
+        base = self._snapshot
+        if base.vectors.dtype == np.uint8 or len(base.vectors) == 0:
+            return False
+        if centroids is None or np.shape(centroids)[1:] != base.vectors.shape[1:]:
+            lists = lists or ivf.default_lists(len(base.vectors))
+            if len(base.vectors) < lists * ivf.MIN_ROWS_PER_LIST:
+                return False
+            centroids, _ = ivf.train_centroids(base.vectors, lists, seed, pool)
+            list_ids = None
+        lists = len(centroids)
+        centroids = np.ascontiguousarray(centroids, dtype=np.float32)
+        if list_ids is None:
+            list_ids = ivf.assign(base.vectors, centroids, pool)
+            built = base._replace(list_ids=list_ids, centroids=centroids)
+            if np.any(np.diff(list_ids) < 0):
+                built = _take_rows(built, np.argsort(list_ids, kind='stable'))
+            postings = (np.arange(len(built.list_ids), dtype=np.int64),
+                        np.searchsorted(built.list_ids, np.arange(lists + 1)))
+        else:
+            list_ids = np.array(list_ids, dtype=np.int32)
+            missing = list_ids < 0
+            list_ids[missing] = ivf.assign(base.vectors[missing], centroids, pool)
+            built = base._replace(list_ids=list_ids, centroids=centroids)
+            postings = ivf.layout(list_ids, lists)
+
+        with self._write_lock:
+            current = self._snapshot
+            if current is not base:
+                # Templates changed while the index was built: keep the
+                # current rows, reuse the list ids computed for rows that
+                # were already there and assign the rest
+                list_ids = _carried_list_ids(built, current)
+                missing = list_ids < 0
+                list_ids[missing] = ivf.assign(current.vectors[missing], centroids)
+                built = current._replace(list_ids=list_ids, centroids=centroids)
+                postings = ivf.layout(list_ids, lists)
+            if built.vectors is not current.vectors:
+                self._buffers = {}
+            self._snapshot = built._replace(postings=postings)
+        return True
+
+    def add(self, template_ids, user_ids, vectors, cohort_stats=None):
+        """Append templates; `vectors` is (n, dim)"""
+        self.update(template_ids, user_ids, vectors, cohort_stats)
+
+    def remove(self, template_ids=(), user_ids=()):
+        """Drop templates by template id and/or every template of the given users"""
+        self.update(remove_template_ids=template_ids, remove_user_ids=user_ids)
+
+    def update(self, template_ids=(), user_ids=(), vectors=None, cohort_stats=None,
+               remove_template_ids=(), remove_user_ids=()):
+        """Remove and append templates in one step, so searches never see a
+        user with a template half replaced. Templates the gallery already
+        holds are not appended again."""
+        with self._write_lock:
+            current = self._snapshot
+            users = current.users
+            if len(template_ids):
+                # A row picked up by a database sync may also be added by
+                # the request that stored it
+                held = np.isin(current.template_ids, template_ids)
+                if held.any():
+                    new = ~np.isin(np.asarray(template_ids, dtype=np.int64), current.template_ids[held])
+                    template_ids = np.asarray(template_ids, dtype=np.int64)[new]
+                    user_ids = np.asarray(user_ids, dtype=np.int64)[new]
+                    vectors = as_templates(vectors).reshape(len(new), -1)[new]
+                    if cohort_stats is not None:
+                        cohort_stats = tuple(np.asarray(stats)[new] for stats in cohort_stats)
+            if len(remove_template_ids) or len(remove_user_ids):
+                removed = np.isin(current.template_ids, list(remove_template_ids))
+                if len(remove_user_ids):
+                    slots = users.lookup(list(remove_user_ids))
+                    removed_users = np.zeros(users.capacity, dtype=bool)
+                    removed_users[slots[slots != id_map.FREE]] = True
+                    removed |= removed_users[current.user_slots]
+                postings = current.postings
+                kept_list_ids = current.list_ids
+                current = _take_rows(current, ~removed)
+                self._buffers = {}
+                if postings is not None:
+                    current = current._replace(
+                        postings=ivf.layout_remove(*postings, kept_list_ids, ~removed))
+                # Users left without templates give their slot back
+                present = np.bincount(current.user_slots, minlength=users.capacity) > 0
+                users = users.without_slots(np.flatnonzero(users.live() & ~present))
+            if len(template_ids):
+                users, user_slots = users.with_ids(user_ids)
+                vectors = as_templates(vectors).reshape(len(template_ids), -1)
+                means, stds = cohort_stats if cohort_stats is not None else _missing_stats(len(vectors))
+                codes = self.coarse_codes(vectors)
+                centroids, postings = current.centroids, current.postings
+                list_ids = (ivf.assign(vectors, centroids) if centroids is not None
+                            else np.full(len(vectors), -1, dtype=np.int32))
+                if centroids is not None:
+                    # New rows join the end of their lists; the gallery is
+                    # not regrouped
+                    postings = ivf.layout_append(*postings, len(current.template_ids), list_ids)
+                if len(current.template_ids) == 0:
+                    current = _empty_snapshot(vectors.shape[1], vectors.dtype, codes.shape[1])
+                new_rows = {
+                    'vectors': vectors,
+                    'template_ids': template_ids,
+                    'user_slots': user_slots,
+                    'cohort_mean': means,
+                    'cohort_std': stds,
+                    'codes': codes,
+                    'list_ids': list_ids
+                }
+                current = current._replace(centroids=centroids, postings=postings, **{
+                    field: self._append_rows(field, getattr(current, field), new_rows[field])
+                    for field in ROW_FIELDS})
+            if users.free_slots > USER_SLOTS_MAX_FREE * users.capacity:
+                users, remap = users.compacted()
+                current = current._replace(user_slots=remap[current.user_slots])
+            self._snapshot = current._replace(users=users)
+
+    def _append_rows(self, field, rows, new):
+        """`rows` followed by `new`. When `rows` is the last view published of
+        a buffer with room left, `new` is written past its end and a longer
+        view returned; otherwise the rows move to a new buffer with spare
+        capacity. Called under the write lock."""
+        buffer, view = self._buffers.get(field, (None, None))
+        total = len(rows) + len(new)
+        if view is not rows or len(buffer) < total:
+            capacity = max(total + int(total * APPEND_HEADROOM), APPEND_MIN_CAPACITY)
+            buffer = np.empty((capacity,) + rows.shape[1:], dtype=rows.dtype)
+            buffer[:len(rows)] = rows
+        buffer[len(rows):total] = new
+        view = buffer[:total]
+        self._buffers[field] = (buffer, view)
+        return view
+
+    def set_cohort_stats(self, template_ids, means, stds):
+        """Attach freshly computed cohort statistics to existing templates"""
+        template_ids = np.asarray(template_ids, dtype=np.int64)
+        if len(template_ids) == 0:
+            return
+        order = np.argsort(template_ids)
+        sorted_ids = template_ids[order]
+        sorted_means = np.asarray(means, dtype=np.float32)[order]
+        sorted_stds = np.asarray(stds, dtype=np.float32)[order]
+        with self._write_lock:
+            current = self._snapshot
+            positions = np.minimum(np.searchsorted(sorted_ids, current.template_ids), len(sorted_ids) - 1)
+            found = sorted_ids[positions] == current.template_ids
+            cohort_mean = current.cohort_mean.copy()
+            cohort_std = current.cohort_std.copy()
+            cohort_mean[found] = sorted_means[positions[found]]
+            cohort_std[found] = sorted_stds[positions[found]]
+            self._snapshot = current._replace(cohort_mean=cohort_mean, cohort_std=cohort_std)
+
+    def cohort_stats_for(self, vectors, user_ids, seed=None):
+        """Compute cohort statistics of templates against a random sample of
+        the current gallery"""
+        snapshot = self._snapshot
+        vectors = as_templates(vectors).reshape(len(user_ids), -1)
+        if len(snapshot.template_ids) == 0:
+            return _missing_stats(len(vectors))
+        rng = np.random.default_rng(seed)
+        size = min(len(snapshot.template_ids), self.cohort_size)
+        sample = rng.choice(len(snapshot.template_ids), size=size, replace=False)
+        return cohort_statistics(vectors, np.asarray(user_ids, dtype=np.int64),
+                                 snapshot.vectors[sample], snapshot.users.ids(snapshot.user_slots[sample]))
+
+    def missing_cohort_stats(self):
+        """Return (template_ids, user_ids, vectors) of templates without statistics"""
+        snapshot = self._snapshot
+        mask = np.isnan(snapshot.cohort_std)
+        return snapshot.template_ids[mask], snapshot.users.ids(snapshot.user_slots[mask]), snapshot.vectors[mask]
+
+    def user_templates(self, user_id):
+        """Return (template_ids, vectors) currently held for one user"""
+        snapshot = self._snapshot
+        mask = snapshot.user_slots == snapshot.users.lookup([user_id])[0]
+        return snapshot.template_ids[mask], snapshot.vectors[mask]
+
+    def search(self, queries, k=1):
+        """Return, for each query row, up to k Matches for distinct users.
+
+        Candidates are shortlisted by raw cosine similarity; within the
+        shortlist they are ranked by cohort Z-score when every candidate has
+        statistics, and by raw score otherwise."""
+        snapshot = self._snapshot
+        if len(snapshot.template_ids) == 0:
+            return [[] for _ in range(len(queries))]
+        queries = as_templates(queries).reshape(-1, snapshot.vectors.shape[1])
+        # Users can own several templates, so shortlist extra candidates
+        # before collapsing to one match per user
+        shortlist = min(len(snapshot.template_ids), k * self.shortlist_factor)
+
+        if snapshot.centroids is not None:
+            return self._ivf_search(queries, snapshot, shortlist, k)
+        candidates = self._coarse_count(snapshot, k, shortlist)
+        if candidates:
+            return self._coarse_search(queries, snapshot, shortlist, k, candidates)
+
+        scores = similarity(queries, snapshot.vectors)
+        return [_top_users(row, snapshot, shortlist, k) for row in scores]
+
+    def _coarse_count(self, snapshot, k, shortlist):
+        """Rows a coarse search of k matches re-scores exactly, or 0 when the
+        gallery is scanned exactly instead"""
+        templates = len(snapshot.template_ids)
+        if not snapshot.codes.shape[1] or templates < self.coarse_min_templates:
+            return 0
+        count = max(self.coarse_candidates, shortlist, int(np.ceil(self.coarse_fraction * k * templates)))
+        return count if count < templates else 0
+
+    def _coarse_search(self, queries, snapshot, shortlist, k, count):
+        """Shortlist the `count` rows closest by Hamming distance of coarse
+        codes, then re-score them exactly"""
+        distances = binary_codes.hamming(self.coarse_codes(queries), snapshot.codes)
+        results = []
+        for query, row in zip(queries, distances):
+            rows = np.argpartition(row, count - 1)[:count]
+            scores = snapshot.vectors[rows] @ query
+            results.append(_top_users(scores, snapshot, shortlist, k, rows))
+        self._count_search(len(queries), 0, len(queries) * count)
+        return results
+
+    def _ivf_search(self, queries, snapshot, shortlist, k):
+        """Score the centroids, then the rows of the lists each query probes"""
+        rows_by_list, offsets = snapshot.postings
+        centroid_scores = queries @ snapshot.centroids.T
+        results = []
+        probed = scored = 0
+        for query, row in zip(queries, centroid_scores):
+            lists = ivf.probe_lists(row, self.ivf_nprobe_min, self.ivf_nprobe_max, self.ivf_margin)
+            rows = np.concatenate([rows_by_list[offsets[i]:offsets[i + 1]] for i in lists])
+            probed += len(lists)
+            scored += len(rows)
+            if len(rows) == 0:
+                results.append([])
+                continue
+            scores = snapshot.vectors[rows] @ query
+            results.append(_top_users(scores, snapshot, min(shortlist, len(rows)), k, rows))
+        self._count_search(len(queries), probed, scored)
+        return results
+
+    def _count_search(self, queries, lists_probed, rows_scored):
+        with self._stats_lock:
+            self._searches += queries
+            self._lists_probed += lists_probed
+            self._rows_scored += rows_scored
+
+    def index_stats(self):
+        """Which search path a single-match search takes, and how much of
+        the gallery a query scans on average"""
+        snapshot = self._snapshot
+        if snapshot.vectors.dtype == np.uint8:
+            kind = 'binary'
+        elif snapshot.centroids is not None:
+            kind = 'ivf'
+        elif self._coarse_count(snapshot, 1, min(len(snapshot.template_ids), self.shortlist_factor)):
+            kind = 'coarse'
+        else:
+            kind = 'exact'
+        with self._stats_lock:
+            searches = max(self._searches, 1)
+            stats = {
+                'type': kind,
+                'templates': len(snapshot.template_ids),
+                'users': len(snapshot.users),
+                'free_user_slots': snapshot.users.free_slots,
+                'lists': 0 if snapshot.centroids is None else len(snapshot.centroids),
+                'avg_lists_probed': round(self._lists_probed / searches, 2),
+                'avg_rows_scored': round(self._rows_scored / searches, 1) if kind in ('ivf', 'coarse') else None
+            }
+        return stats
+
+
+def _top_users(row, snapshot, shortlist, k, rows=None):
+    """Best matches of one query; `row` holds the scores of gallery rows
+    `rows` (every row when None)"""
+    if shortlist < len(row):
+        candidates = np.argpartition(row, -shortlist)[-shortlist:]
+    else:
+        candidates = np.arange(len(row))
+
+    raw = row[candidates]
+    if rows is not None:
+        candidates = rows[candidates]
+    z_scores = (raw - snapshot.cohort_mean[candidates]) / snapshot.cohort_std[candidates]
+    ranking = z_scores if np.all(np.isfinite(z_scores)) else raw
+    order = np.argsort(ranking)[::-1]
+
+    matches = []
+    seen = set()
+    for position in order:
+        index = candidates[position]
+        slot = int(snapshot.user_slots[index])
+        if slot in seen:
+            continue
+        seen.add(slot)
+        matches.append(Match(int(snapshot.users.external[slot]), int(snapshot.template_ids[index]),
+                             float(raw[position]), float(z_scores[position])))
+        if len(matches) == k:
+            break
+    return matches
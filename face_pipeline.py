@@ -0,0 +1,171 @@
+"""
+Face detection and embedding
+
+Uses DeepFace (VGG-Face) when it is installed. Without it the server runs
+in simplified mode: the face is assumed to fill the centre of the frame
+(kiosk enrollment framing) and is described by a normalized grayscale
+pixel descriptor. That keeps the whole pipeline exercisable in tests but
+is not a real face recognizer.
+
+All embeddings are float32 and L2-normalized, so cosine similarity is a
+dot product.
+"""
+
+import logging
+import threading
+
+import numpy as np
+from PIL import Image
+
+logger = logging.getLogger(__name__)
+
+try:
+    from deepface import DeepFace
+    DEEPFACE_AVAILABLE = True
+except ImportError:
+    DeepFace = None
+    DEEPFACE_AVAILABLE = False
+
+DEEPFACE_MODEL = 'VGG-Face'
+DETECTOR_BACKEND = 'opencv'
+
+# Simplified-mode descriptor: grayscale crop resized to (width, height)
+PIXEL_DESCRIPTOR_SIZE = (16, 32)
+
+MODEL_NAME = DEEPFACE_MODEL if DEEPFACE_AVAILABLE else 'pixel-16x32'
+
+# Batched DeepFace forward pass: (model, (height, width)) once checked
+# against DeepFace.represent, False when this DeepFace version's
+# preprocessing could not be matched (faces then go one represent() call
+# each), None before the first batch
+_batch_model = None
+_batch_model_lock = threading.Lock()
+
+
+def configure_threads(intra_op, inter_op):
+    """Bound TensorFlow's own thread pools: `intra_op` threads inside one
+    operation, `inter_op` operations at once. Must run before the first
+    model call. numpy's BLAS threads are set through OMP_NUM_THREADS and
+    friends before numpy is imported (see gunicorn.conf.py)."""
+    if not DEEPFACE_AVAILABLE:
+        return
+    try:
+        import tensorflow as tf
+        tf.config.threading.set_intra_op_parallelism_threads(intra_op)
+        tf.config.threading.set_inter_op_parallelism_threads(inter_op)
+    except (ImportError, RuntimeError) as e:
+        logger.warning(f"Could not configure TensorFlow threads: {e}")
+
+
+def face_crop_box(image):
+    """Return a square (left, top, right, bottom) box around the centre of the
+    frame, where kiosk enrollment framing puts the face"""
+    width, height = image.size
+    side = int(min(width, height) * 0.8)
+    left = (width - side) // 2
+    top = (height - side) // 2
+    return (left, top, left + side, top + side)
+
+
+def detect_faces(image):
+    """Return the (left, top, right, bottom) boxes of every face in the image"""
+    if not DEEPFACE_AVAILABLE:
+        return [face_crop_box(image)]
+
+    faces = DeepFace.extract_faces(
+        img_path=np.asarray(image.convert('RGB'))[:, :, ::-1],
+        detector_backend=DETECTOR_BACKEND,
+        enforce_detection=False,
+        align=True
+    )
+    boxes = []
+    for face in faces:
+        area = face['facial_area']
+        # With enforce_detection off, "no face" comes back as the whole frame
+        # with zero confidence
+        if face.get('confidence', 1) <= 0:
+            continue
+        boxes.append((area['x'], area['y'], area['x'] + area['w'], area['y'] + area['h']))
+    return boxes
+
+
+def largest_face(boxes):
+    """Pick the face closest to the camera (largest box)"""
+    return max(boxes, key=lambda box: (box[2] - box[0]) * (box[3] - box[1]))
+
+
+def normalize(vectors):
+    """L2-normalize rows in place and return them"""
+    norms = np.linalg.norm(vectors, axis=1, keepdims=True)
+    np.divide(vectors, norms, out=vectors, where=norms > 0)
+    return vectors
+
+
+def _represent(crop):
+    """Embedding of one BGR face crop through DeepFace's own pipeline"""
+    result = DeepFace.represent(
+        img_path=np.ascontiguousarray(crop),
+        model_name=DEEPFACE_MODEL,
+        detector_backend='skip',
+        enforce_detection=False
+    )
+    return np.asarray(result[0]['embedding'], dtype=np.float32)
+
+
+def _forward(model, input_size, crops):
+    """Embed BGR face crops in one forward pass, preprocessed as
+    DeepFace.represent does (RGB, resized and padded, base normalization)"""
+    from deepface.modules import preprocessing
+    batch = np.concatenate([
+        preprocessing.normalize_input(
+            img=preprocessing.resize_image(img=crop[:, :, ::-1], target_size=input_size),
+            normalization='base')
+        for crop in crops
+    ])
+    return np.asarray(model(batch, training=False), dtype=np.float32).reshape(len(crops), -1)
+
+
+def _deepface_batch_model(crop):
+    """The batched model, checked once on `crop` against represent(): a
+    DeepFace version whose preprocessing differs would otherwise produce
+    templates that do not match enrolled ones"""
+    global _batch_model
+    with _batch_model_lock:
+        if _batch_model is None:
+            try:
+                client = DeepFace.build_model(DEEPFACE_MODEL)
+                width, height = client.input_shape
+                candidate = (getattr(client, 'model', client), (height, width))
+                batched = normalize(_forward(*candidate, [crop]))[0]
+                reference = _represent(crop)
+                agreement = float(batched @ reference) / max(float(np.linalg.norm(reference)), 1e-12)
+                _batch_model = candidate if agreement > 0.999 else False
+                if not _batch_model:
+                    logger.warning(f"Batched embeddings differ from DeepFace.represent (cosine {agreement:.4f}); "
+                                   "embedding faces one at a time")
+            except Exception as e:
+                logger.warning(f"Batched DeepFace embedding unavailable ({e}); embedding faces one at a time")
+                _batch_model = False
+        return _batch_model
+
+
+def embed_faces(image, boxes):
+    """Embed every face box of an already-decoded image as one (n, dim) batch"""
+    if not boxes:
+        return np.zeros((0, 0), dtype=np.float32)
+
+    if DEEPFACE_AVAILABLE:
+        bgr = np.asarray(image.convert('RGB'))[:, :, ::-1]
+        crops = [bgr[top:bottom, left:right] for left, top, right, bottom in boxes]
+        batch_model = _deepface_batch_model(crops[0])
+        if batch_model:
+            return normalize(_forward(*batch_model, crops))
+        return normalize(np.stack([_represent(crop) for crop in crops]))
+
+    gray = image.convert('L')
+    batch = np.stack([
+        np.asarray(gray.resize(PIXEL_DESCRIPTOR_SIZE, Image.BILINEAR, box=box), dtype=np.float32).ravel()
+        for box in boxes
+    ])
+    batch -= batch.mean(axis=1, keepdims=True)
+    return normalize(batch)
@@ -0,0 +1,132 @@
+"""
+Early exit for kiosk frames without a face
+
+Most frames a kiosk sends show its empty scene. Before the full decode and
+the detector, each frame is reduced to a tiny grayscale thumbnail (JPEG
+frames are decoded at 1/8 scale through PIL's draft mode, so this takes
+well under a millisecond) and two checks can answer "no face" on the spot:
+
+- flat frame: next to no contrast (covered lens, lights off, blank frame)
+- unchanged scene: per camera, the thumbnail of the last frame in which the
+  detector found no face is kept as the reference; the thumbnail is split
+  into a MOTION_GRID of cells, and a frame whose mean absolute difference
+  from it stays below `motion_threshold` grey levels in every cell shows
+  the same empty scene. Comparing per cell keeps a small change (a person
+  at the edge of the view or far back) from being averaged away over the
+  whole frame
+
+The reference only ever comes from frames the detector saw as empty, so a
+person stepping in changes the frame and goes through the full pipeline.
+It expires after `max_age` seconds, so the detector re-checks a scene
+that drifts slowly (lighting) instead of the gate trusting it forever.
+"""
+
+import io
+import threading
+import time
+from collections import OrderedDict
+
+import numpy as np
+from PIL import Image
+
+THUMBNAIL_SIZE = (32, 24)
+# Thumbnails with a grey-level standard deviation below this are flat
+FLAT_MAX_STD = 2.0
+# (columns, rows) of cells the motion check compares separately; they
+# must divide THUMBNAIL_SIZE
+MOTION_GRID = (4, 4)
+
+
+class FrameGate:
+    def __init__(self, enabled=True, motion_threshold=3.0, max_age=10.0, max_cameras=4096):
+        self.enabled = enabled
+        self.motion_threshold = motion_threshold
+        self.max_age = max_age
+        self.max_cameras = max_cameras
+        # camera id -> (thumbnail, monotonic time, region), least recently
+        # used first
+        self._references = OrderedDict()
+        self._lock = threading.Lock()
+        self._frames = 0
+        self._flat = 0
+        self._unchanged = 0
+        self._seconds = 0.0
+
+    def screen(self, camera_id, image_data, region=None):
+        """Return (thumbnail, empty): `empty` is True when the frame can be
+        answered with "no face" without the detector. Only the `region` box
+        is looked at when given, so motion outside it does not count. The
+        thumbnail is None when the gate is off or the frame cannot be read;
+        the full decode reports that."""
+        if not self.enabled:
+            return None, False
+        started = time.perf_counter()
+        try:
+            thumbnail = _thumbnail(image_data, region)
+        except Exception:
+            return None, False
+        flat = float(thumbnail.std()) < FLAT_MAX_STD
+        unchanged = False
+        if not flat and camera_id is not None:
+            with self._lock:
+                reference = self._references.get(camera_id)
+            if (reference is not None and reference[2] == region
+                    and time.monotonic() - reference[1] <= self.max_age):
+                unchanged = motion(thumbnail, reference[0]) < self.motion_threshold
+        with self._lock:
+            self._frames += 1
+            self._flat += flat
+            self._unchanged += unchanged
+            self._seconds += time.perf_counter() - started
+        return thumbnail, flat or unchanged
+
+    def observe(self, camera_id, thumbnail, has_faces, region=None):
+        """Record the detector's verdict on a screened frame: an empty frame
+        (of `region`) becomes the camera's reference, a frame with faces
+        clears it"""
+        if camera_id is None or thumbnail is None:
+            return
+        with self._lock:
+            if has_faces:
+                self._references.pop(camera_id, None)
+                return
+            self._references[camera_id] = (thumbnail.astype(np.int16), time.monotonic(), region)
+            self._references.move_to_end(camera_id)
+            while len(self._references) > self.max_cameras:
+                self._references.popitem(last=False)
+
+    def stats(self):
+        with self._lock:
+            return {
+                'enabled': self.enabled,
+                'frames': self._frames,
+                'skipped_flat': self._flat,
+                'skipped_unchanged': self._unchanged,
+                'cameras': len(self._references),
+                'avg_screen_ms': round(self._seconds / max(self._frames, 1) * 1000, 3)
+            }
+
+
+def motion(thumbnail, reference):
+    """Largest mean absolute grey-level difference over the MOTION_GRID
+    cells of two thumbnails"""
+    columns, rows = MOTION_GRID
+    height, width = thumbnail.shape
+    difference = np.abs(thumbnail.astype(np.int16) - reference)
+    cells = difference.reshape(rows, height // rows, columns, width // columns)
+    return float(cells.mean(axis=(1, 3)).max())
+
+
+def _thumbnail(image_data, region=None):
+    """THUMBNAIL_SIZE grayscale thumbnail of an encoded frame, or of its
+    (left, top, right, bottom) `region`"""
+    image = Image.open(io.BytesIO(image_data))
+    width, height = image.size
+    left, top, right, bottom = region or (0, 0, width, height)
+    # JPEG only: decode straight to grayscale at the smallest DCT scale
+    # that still covers the region with twice the thumbnail size
+    image.draft('L', (-(-2 * THUMBNAIL_SIZE[0] * width // (right - left)),
+                      -(-2 * THUMBNAIL_SIZE[1] * height // (bottom - top))))
+    scale_x, scale_y = image.size[0] / width, image.size[1] / height
+    box = (left * scale_x, top * scale_y, right * scale_x, bottom * scale_y)
+    return np.asarray(image.convert('L').resize(THUMBNAIL_SIZE, Image.BILINEAR, box=box), dtype=np.uint8)
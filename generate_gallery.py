@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+"""
+Synthetic face galleries for offline scale and latency testing
+
+Generates embeddings with realistic structure instead of real faces:
+identities are grouped into clusters (think demographics or capture
+conditions), so impostors from the same cluster score higher than
+unrelated ones, and every identity owns several noisy templates.
+
+Noise levels are derived from the target mean cosine similarities: for a
+unit centre c and Gaussian noise with per-dimension deviation s in d
+dimensions, two samples have expected cosine 1 / (1 + d * s^2).
+
+Usage:
+    python generate_gallery.py --identities 1000000 --database scale.db
+    python generate_gallery.py --identities 100000 --arrays gallery_100k/ --probes 10000
+
+--database inserts users and face_encodings rows (with cohort statistics)
+that the server loads at startup. --arrays writes .npy files for offline
+index tests: vectors, template_ids, user_ids, and with --probes,
+probe_vectors and probe_user_ids (-1 marks an impostor that is not
+enrolled).
+"""
+
+import argparse
+import hashlib
+import os
+import sqlite3
+import sys
+import time
+
+import numpy as np
+
+import face_index
+from face_pipeline import normalize
+
+# Matches the simplified-mode pixel descriptor, so generated galleries load
+# into a server running without DeepFace
+DEFAULT_DIM = 512
+# Identities whose centre noise is drawn from one seeded stream
+CENTRE_BLOCK = 1024
+
+
+def noise_scale(similarity, dim):
+    """Per-dimension noise deviation giving the target mean cosine similarity"""
+    return np.sqrt((1.0 / similarity - 1.0) / dim)
+
+
+class SyntheticGallery:
+    def __init__(self, identities, dim=DEFAULT_DIM, clusters=64, templates_per_identity=(1, 3),
+                 intra_similarity=0.7, cluster_similarity=0.15, seed=0):
+        self.identities = identities
+        self.dim = dim
+        self.templates_per_identity = templates_per_identity
+        self.intra_scale = noise_scale(intra_similarity, dim)
+        self.cluster_scale = noise_scale(cluster_similarity, dim)
+        self.seed = seed
+        rng = np.random.default_rng(seed)
+        self.cluster_centres = normalize(rng.standard_normal((clusters, dim)).astype(np.float32))
+        self.identity_clusters = rng.integers(0, clusters, size=identities)
+        self.template_counts = rng.integers(templates_per_identity[0], templates_per_identity[1] + 1,
+                                            size=identities)
+
+    def identity_centres(self, indices):
+        """Centres of the given identities. Noise is drawn per fixed block of
+        identities, so an identity gets the same centre whether it is
+        generated with the whole gallery or alone as a probe"""
+        indices = np.asarray(indices)
+        centres = self.cluster_centres[self.identity_clusters[indices]].copy()
+        blocks = indices // CENTRE_BLOCK
+        for block in np.unique(blocks):
+            rng = np.random.default_rng((self.seed, 1, int(block)))
+            noise = rng.standard_normal((CENTRE_BLOCK, self.dim), dtype=np.float32)
+            rows = blocks == block
+            centres[rows] += noise[indices[rows] % CENTRE_BLOCK] * self.cluster_scale
+        return normalize(centres)
+
+    def samples(self, centres, counts, stream, start):
+        """Noisy samples of each centre, `counts[i]` for centre i"""
+        rng = np.random.default_rng((self.seed, stream, start))
+        repeated = np.repeat(centres, counts, axis=0)
+        repeated += rng.standard_normal(repeated.shape, dtype=np.float32) * self.intra_scale
+        return normalize(repeated)
+
+    def blocks(self, block_size):
+        """Yield (identity_index, template_vectors) per block of identities"""
+        for start in range(0, self.identities, block_size):
+            stop = min(start + block_size, self.identities)
+            counts = self.template_counts[start:stop]
+            vectors = self.samples(self.identity_centres(np.arange(start, stop)), counts, 2, start)
+            yield np.repeat(np.arange(start, stop), counts), vectors
+
+    def template_sample(self, size):
+        """`size` templates drawn uniformly at random without replacement.
+        Returns (identity index, vectors)."""
+        rng = np.random.default_rng((self.seed, 5))
+        total = int(self.template_counts.sum())
+        rows = rng.choice(total, size=min(size, total), replace=False)
+        identities = np.searchsorted(np.cumsum(self.template_counts), rows, side='right')
+        vectors = self.samples(self.identity_centres(identities), np.ones(len(rows), dtype=int), 5, 0)
+        return identities, vectors
+
+    def probes(self, count, impostor_fraction):
+        """Fresh samples of enrolled identities plus impostors outside the
+        gallery. Returns (vectors, identity index or -1)."""
+        rng = np.random.default_rng((self.seed, 3))
+        impostors = int(count * impostor_fraction)
+        genuine = rng.integers(0, self.identities, size=count - impostors)
+        centres = self.identity_centres(genuine)
+
+        outsiders = SyntheticGallery(impostors, self.dim, len(self.cluster_centres), seed=self.seed + 1)
+        outsiders.cluster_centres = self.cluster_centres
+        outsider_centres = outsiders.identity_centres(np.arange(impostors))
+
+        vectors = self.samples(np.concatenate([centres, outsider_centres]), np.ones(count, dtype=int), 4, 0)
+        labels = np.concatenate([genuine, np.full(impostors, -1)])
+        return vectors, labels
+
+
+def write_database(gallery, path, model_name, block_size):
+    """Insert synthetic users and templates in one transaction, with
+    explicit ids continuing after any existing rows"""
+    import app as server
+
+    server.DATABASE = path
+    server.init_database()
+    conn = sqlite3.connect(path)
+    conn.execute('PRAGMA synchronous = OFF')
+    conn.execute('PRAGMA journal_mode = MEMORY')
+    first_user_id = (conn.execute('SELECT MAX(id) FROM users').fetchone()[0] or 0) + 1
+    first_template_id = (conn.execute('SELECT MAX(id) FROM face_encodings').fetchone()[0] or 0) + 1
+
+    # Templates are what the server stores: cancelable codes when
+    # TEMPLATE_KEY is set, the embeddings otherwise
+    templates = server.cancelable.protect if server.cancelable.is_enabled() else (lambda vectors: vectors)
+
+    # Cohort statistics are computed as Gallery.cohort_stats_for() does it
+    # on the server: against index.cohort_size templates drawn at random,
+    # without replacement, from the whole gallery. The drawn templates are
+    # fresh samples of their identities, which follow the same distribution
+    # as the stored ones, so the gallery is not generated twice.
+    cohort_users, cohort_vectors = gallery.template_sample(server.gallery.cohort_size)
+    cohort_vectors = templates(cohort_vectors)
+
+    template_id = first_template_id
+    total = 0
+    for identity_index, vectors in gallery.blocks(block_size):
+        start, stop = int(identity_index[0]), int(identity_index[-1]) + 1
+        conn.executemany(
+            'INSERT INTO users (id, name, department, email) VALUES (?, ?, ?, ?)',
+            ((first_user_id + i, f'Synthetic User {i}', f'Synthetic Cluster {gallery.identity_clusters[i]}',
+              f'synthetic-{first_user_id + i}@synthetic.local') for i in range(start, stop))
+        )
+        vectors = templates(vectors)
+        means, stds = face_index.cohort_statistics(vectors, identity_index, cohort_vectors, cohort_users)
+        rows = []
+        for vector, identity, mean, std in zip(vectors, identity_index, means, stds):
+            rows.append((template_id, first_user_id + int(identity), hashlib.md5(vector.tobytes()).hexdigest(),
+                         model_name, server.encode_embedding(vector), 'enrollment',
+                         server.optional_float(mean), server.optional_float(std)))
+            template_id += 1
+        conn.executemany('''
+            INSERT INTO face_encodings (id, user_id, encoding_hash, model_name, embedding, source,
+                                        cohort_mean, cohort_std)
+            VALUES (?, ?, ?, ?, ?, ?, ?, ?)
+        ''', rows)
+        total += len(rows)
+        print(f"   {stop}/{gallery.identities} identities, {total} templates", end='\r', flush=True)
+    conn.commit()
+    conn.close()
+    print()
+    return first_user_id, first_template_id
+
+
+def write_arrays(gallery, directory, block_size, probes, impostor_fraction):
+    """Stream the gallery into .npy files without holding it in memory"""
+    os.makedirs(directory, exist_ok=True)
+    templates = int(gallery.template_counts.sum())
+    vectors = np.lib.format.open_memmap(os.path.join(directory, 'vectors.npy'), mode='w+',
+                                        dtype=np.float32, shape=(templates, gallery.dim))
+    user_ids = np.lib.format.open_memmap(os.path.join(directory, 'user_ids.npy'), mode='w+',
+                                         dtype=np.int64, shape=(templates,))
+    offset = 0
+    for identity_index, block in gallery.blocks(block_size):
+        vectors[offset:offset + len(block)] = block
+        user_ids[offset:offset + len(block)] = identity_index + 1
+        offset += len(block)
+    vectors.flush()
+    user_ids.flush()
+    np.save(os.path.join(directory, 'template_ids.npy'), np.arange(1, templates + 1, dtype=np.int64))
+
+    if probes:
+        probe_vectors, labels = gallery.probes(probes, impostor_fraction)
+        np.save(os.path.join(directory, 'probe_vectors.npy'), probe_vectors)
+        np.save(os.path.join(directory, 'probe_user_ids.npy'), np.where(labels >= 0, labels + 1, -1))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--identities', type=int, default=10000)
+    parser.add_argument('--dim', type=int, default=DEFAULT_DIM)
+    parser.add_argument('--clusters', type=int, default=64)
+    parser.add_argument('--min-templates', type=int, default=1)
+    parser.add_argument('--max-templates', type=int, default=3)
+    parser.add_argument('--intra-similarity', type=float, default=0.7,
+                        help='mean cosine between templates of one identity')
+    parser.add_argument('--cluster-similarity', type=float, default=0.15,
+                        help='mean cosine between identities of one cluster')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--block-size', type=int, default=10000, help='identities generated per step')
+    parser.add_argument('--database', help='SQLite database to insert users and templates into')
+    parser.add_argument('--model-name', help='face_encodings.model_name (default: the active template model)')
+    parser.add_argument('--arrays', help='directory for .npy output')
+    parser.add_argument('--probes', type=int, default=0, help='probe vectors to write with --arrays')
+    parser.add_argument('--impostor-fraction', type=float, default=0.2)
+    args = parser.parse_args()
+
+    if not args.database and not args.arrays:
+        parser.error('give --database and/or --arrays')
+
+    gallery = SyntheticGallery(args.identities, args.dim, args.clusters,
+                               (args.min_templates, args.max_templates),
+                               args.intra_similarity, args.cluster_similarity, args.seed)
+    print(f"🧬 {args.identities} identities, {int(gallery.template_counts.sum())} templates, "
+          f"{args.dim} dims, {args.clusters} clusters")
+
+    if args.database:
+        import app as server
+        model_name = args.model_name or server.TEMPLATE_MODEL
+        started = time.perf_counter()
+        first_user_id, _ = write_database(gallery, args.database, model_name, args.block_size)
+        print(f"✅ Wrote users {first_user_id}..{first_user_id + args.identities - 1} to {args.database} "
+              f"as model '{model_name}' in {time.perf_counter() - started:.1f}s")
+
+    if args.arrays:
+        started = time.perf_counter()
+        write_arrays(gallery, args.arrays, args.block_size, args.probes, args.impostor_fraction)
+        print(f"✅ Wrote arrays to {args.arrays} in {time.perf_counter() - started:.1f}s")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
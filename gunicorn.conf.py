@@ -0,0 +1,70 @@
+"""
+Gunicorn settings for production
+
+    gunicorn -c gunicorn.conf.py app:app
+
+Graceful drain: on SIGTERM (Railway deploys and restarts) the master stops
+accepting connections, workers finish in-flight requests within
+GRACEFUL_TIMEOUT, and each worker then drains background work and saves
+the gallery snapshot (app.shutdown) before exiting.
+
+Hot restart: SIGHUP replaces the workers with new ones running the current
+code. SIGUSR2 re-executes the master itself (new dependencies or Python),
+handing the listening socket to the new process; once its workers are up,
+SIGTERM the old master. Either way the socket stays open and no
+connection is refused.
+
+Live settings (see config.py) reload without any restart on SIGUSR1 to
+the master, which forwards it to every worker.
+
+Every worker holds its own copy of the gallery and picks up templates the
+others stored every GALLERY_SYNC_INTERVAL seconds (see app.sync_gallery),
+which also covers old workers that finish an enrollment after the new
+ones loaded. Copies cost memory, so keep WEB_CONCURRENCY at 1 and scale
+with threads.
+"""
+
+import os
+import sys
+
+import config as server_config
+
+_settings = server_config.load()
+
+bind = f"0.0.0.0:{_settings['server.port']}"
+workers = int(os.environ.get('WEB_CONCURRENCY', 1))
+graceful_timeout = _settings['server.graceful_timeout']
+# Loading a large gallery happens before the worker's first heartbeat
+timeout = _settings['server.worker_timeout']
+
+# Event loop plus a small thread pool: the gthread worker parks idle
+# keep-alive connections in epoll and hands a connection to a thread only
+# while one of its requests is being served. Thousands of mostly idle
+# kiosks then cost a file descriptor each rather than a thread; requests
+# beyond `threads` queue for the next free thread and CPU-heavy work queues
+# again for the inference pool. Keep keepalive above the idle timeout of
+# any proxy in front, and worker_connections above the number of kiosks.
+worker_class = 'gthread'
+threads = _settings['server.http_threads']
+keepalive = _settings['server.keepalive']
+worker_connections = _settings['server.worker_connections']
+
+# Intra-op threads of native math libraries are read when they load, so set
+# them in the worker environment before the app (and numpy) is imported.
+# Parallelism comes from the inference pool, one call per physical core.
+_intra_op = str(_settings['inference.intra_op_threads'])
+raw_env = [f'{name}={os.environ.get(name, _intra_op)}'
+           for name in ('OMP_NUM_THREADS', 'OPENBLAS_NUM_THREADS', 'MKL_NUM_THREADS')]
+
+
+def post_worker_init(worker):
+    import app
+    if not app.startup():
+        worker.log.error("Failed to initialize database. Exiting...")
+        # Boot errors stop the master instead of respawning forever
+        sys.exit(3)
+
+
+def worker_exit(server, worker):
+    import app
+    app.shutdown()
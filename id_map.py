@@ -0,0 +1,104 @@
+"""
+Dense internal ids for gallery users
+
+users.id is an AUTOINCREMENT rowid: 64-bit and full of gaps once users are
+deleted. The gallery stores a dense 32-bit slot per template instead, so
+per-user arrays and bitmaps are indexed by slot directly (np.zeros(capacity)
+rather than a sort or a dict over user ids) and the per-row id column
+takes half the memory.
+
+An IdMap is immutable, like the gallery snapshot it is published with: a
+search on an older snapshot keeps mapping slots back to the users that
+snapshot was built with. Slots freed by deleted users are handed to the
+next enrolled users, lowest first. compacted() renumbers the live slots
+to 0..len-1 when deletions leave too many holes.
+"""
+
+import numpy as np
+
+FREE = -1
+
+
+class IdMap:
+    """Bidirectional mapping between external ids and dense int32 slots;
+    `external[slot]` is the id in that slot, or FREE"""
+
+    def __init__(self, external=()):
+        self.external = np.asarray(external, dtype=np.int64)
+        self._index = None
+
+    @classmethod
+    def build(cls, ids):
+        """Map of the distinct `ids` in slots 0..n-1, and the slot of every
+        entry of `ids`"""
+        unique, slots = np.unique(np.asarray(ids, dtype=np.int64), return_inverse=True)
+        return cls(unique), slots.astype(np.int32)
+
+    def __len__(self):
+        return len(self._sorted()[0])
+
+    @property
+    def capacity(self):
+        return len(self.external)
+
+    @property
+    def free_slots(self):
+        return self.capacity - len(self)
+
+    def live(self):
+        """Boolean mask of the slots in use"""
+        return self.external != FREE
+
+    def _sorted(self):
+        # Built on first lookup; maps are immutable, so a racing rebuild
+        # yields the same arrays
+        if self._index is None:
+            slots = np.flatnonzero(self.live()).astype(np.int32)
+            order = np.argsort(self.external[slots], kind='stable')
+            self._index = (self.external[slots][order], slots[order])
+        return self._index
+
+    def lookup(self, ids):
+        """Slots of external `ids`, FREE for ids without one"""
+        ids = np.asarray(ids, dtype=np.int64).reshape(-1)
+        sorted_ids, sorted_slots = self._sorted()
+        if len(sorted_ids) == 0:
+            return np.full(len(ids), FREE, dtype=np.int32)
+        positions = np.minimum(np.searchsorted(sorted_ids, ids), len(sorted_ids) - 1)
+        return np.where(sorted_ids[positions] == ids, sorted_slots[positions], FREE).astype(np.int32)
+
+    def ids(self, slots):
+        """External ids of `slots`"""
+        return self.external[slots]
+
+    def with_ids(self, ids):
+        """Map that also holds `ids`, and the slot of every entry of `ids`.
+        New ids take freed slots first, then slots past the end."""
+        ids = np.asarray(ids, dtype=np.int64).reshape(-1)
+        slots = self.lookup(ids)
+        new_ids = np.unique(ids[slots == FREE])
+        if len(new_ids) == 0:
+            return self, slots
+        free = np.flatnonzero(~self.live())[:len(new_ids)]
+        appended = len(new_ids) - len(free)
+        external = np.concatenate([self.external, np.full(appended, FREE, dtype=np.int64)])
+        new_slots = np.concatenate([free, np.arange(self.capacity, self.capacity + appended)])
+        external[new_slots] = new_ids
+        updated = IdMap(external)
+        return updated, updated.lookup(ids)
+
+    def without_slots(self, slots):
+        """Map with `slots` freed"""
+        if len(slots) == 0:
+            return self
+        external = self.external.copy()
+        external[slots] = FREE
+        return IdMap(external)
+
+    def compacted(self):
+        """Map with live slots renumbered 0..len-1 in slot order, and the
+        new slot of every old slot (FREE for freed ones)"""
+        live = self.live()
+        remap = np.full(self.capacity, FREE, dtype=np.int32)
+        remap[live] = np.arange(int(live.sum()), dtype=np.int32)
+        return IdMap(self.external[live]), remap
@@ -0,0 +1,246 @@
+"""
+Encryption at rest for stored face images
+
+Files are sealed with AES-256-GCM through OpenSSL (via `cryptography`),
+which uses AES-NI/VAES on x86 and the ARMv8 crypto extensions on arm64.
+The plaintext is split into fixed-size chunks that are sealed
+independently, so files are written chunk by chunk and any byte range can
+be served by decrypting only the chunks it touches.
+
+On-disk layout (all integers big-endian):
+
+    header   magic b'FRE1' | chunk_size u32 | nonce_prefix 8 bytes
+    chunk i  AES-GCM(plaintext[i*chunk_size:(i+1)*chunk_size]) + 16-byte tag
+
+Chunk i uses nonce = nonce_prefix || i (u32) and authenticates the header
+plus a final-chunk flag, so chunks cannot be reordered, swapped between
+files or truncated without failing authentication. An empty plaintext is
+stored as a single empty final chunk.
+
+The same format seals small in-memory blobs such as stored embeddings.
+
+Encryption is enabled by setting FACE_ENCRYPTION_KEY to a base64-encoded
+32-byte key. With a key, files and blobs without the magic header are
+rejected: otherwise anyone able to write to storage could swap in
+unencrypted content. Stores written before the key was configured are
+read by also setting FACE_ENCRYPTION_ALLOW_PLAINTEXT=1 while they are
+re-encrypted or re-enrolled; in that mode data without the header, or whose
+header does not authenticate (a plaintext blob that happens to start with
+the magic), is read as plaintext.
+"""
+
+import base64
+import os
+import struct
+
+from cryptography.exceptions import InvalidTag
+from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+
+MAGIC = b'FRE1'
+HEADER = struct.Struct('>4sI8s')
+TAG_SIZE = 16
+DEFAULT_CHUNK_SIZE = 64 * 1024
+
+_aead = None
+_allow_plaintext = False
+
+
+class PlaintextRejected(ValueError):
+    """Unencrypted data found while encryption is enabled"""
+
+
+def configure(key, allow_plaintext=False):
+    """Enable encryption with a raw 32-byte key, or disable it with None.
+    `allow_plaintext` keeps unencrypted data readable while migrating."""
+    global _aead, _allow_plaintext
+    _allow_plaintext = allow_plaintext
+    if key is None:
+        _aead = None
+        return
+    if len(key) != 32:
+        raise ValueError('Encryption key must be 32 bytes (AES-256)')
+    _aead = AESGCM(key)
+
+
+def configure_from_env():
+    """Load the key from FACE_ENCRYPTION_KEY and the migration flag from
+    FACE_ENCRYPTION_ALLOW_PLAINTEXT; returns True if encryption is on"""
+    encoded = os.environ.get('FACE_ENCRYPTION_KEY')
+    allow_plaintext = os.environ.get('FACE_ENCRYPTION_ALLOW_PLAINTEXT', '').lower() in ('1', 'true', 'yes', 'on')
+    configure(base64.b64decode(encoded) if encoded else None, allow_plaintext)
+    return _aead is not None
+
+
+def is_enabled():
+    return _aead is not None
+
+
+def accepts_plaintext():
+    """Whether unencrypted files and blobs may be read"""
+    return _aead is None or _allow_plaintext
+
+
+def _nonce(prefix, index):
+    return prefix + struct.pack('>I', index)
+
+
+def _aad(header, last):
+    return header + (b'\x01' if last else b'\x00')
+
+
+def encrypt_chunks(data, chunk_size=DEFAULT_CHUNK_SIZE):
+    """Yield the header followed by each sealed chunk of `data`"""
+    prefix = os.urandom(8)
+    header = HEADER.pack(MAGIC, chunk_size, prefix)
+    yield header
+
+    view = memoryview(data)
+    count = max(1, -(-len(view) // chunk_size))
+    for index in range(count):
+        chunk = view[index * chunk_size:(index + 1) * chunk_size]
+        yield _aead.encrypt(_nonce(prefix, index), bytes(chunk), _aad(header, index == count - 1))
+
+
+def encrypt_bytes(data, chunk_size=DEFAULT_CHUNK_SIZE):
+    """Seal `data` into the chunked format in memory"""
+    return b''.join(encrypt_chunks(data, chunk_size))
+
+
+def write_file(path, data, chunk_size=DEFAULT_CHUNK_SIZE):
+    """Encrypt `data` to `path`, handing each sealed chunk to the kernel as soon
+    as it is produced. The file is written under a temporary name and
+    renamed, so readers never see a partial file."""
+    tmp_path = f"{path}.{os.urandom(4).hex()}.tmp"
+    fd = os.open(tmp_path, os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0o600)
+    try:
+        for block in encrypt_chunks(data, chunk_size):
+            os.write(fd, block)
+    finally:
+        os.close(fd)
+    os.replace(tmp_path, path)
+
+
+def decrypt_bytes(blob):
+    """Open a blob produced by encrypt_bytes(). Without a key blobs are
+    plaintext; with one, plaintext is only accepted while migrating."""
+    if _aead is None:
+        if blob[:len(MAGIC)] == MAGIC:
+            raise RuntimeError('Blob is encrypted but FACE_ENCRYPTION_KEY is not set')
+        return blob
+    if blob[:len(MAGIC)] != MAGIC or len(blob) < HEADER.size + TAG_SIZE:
+        if not _allow_plaintext:
+            raise PlaintextRejected('Blob is not encrypted')
+        return blob
+    if not _allow_plaintext:
+        return _open_blob(blob)
+    try:
+        return _open_blob(blob)
+    except InvalidTag:
+        return blob
+
+
+def _open_blob(blob):
+    header = blob[:HEADER.size]
+    _, chunk_size, prefix = HEADER.unpack(header)
+    sealed_chunk = chunk_size + TAG_SIZE
+    body = memoryview(blob)[HEADER.size:]
+    count = max(1, -(-len(body) // sealed_chunk))
+    return b''.join(
+        _aead.decrypt(_nonce(prefix, index), bytes(body[index * sealed_chunk:(index + 1) * sealed_chunk]),
+                      _aad(header, index == count - 1))
+        for index in range(count)
+    )
+
+
+def is_encrypted_file(path):
+    with open(path, 'rb') as f:
+        return f.read(len(MAGIC)) == MAGIC
+
+
+def check_plaintext_file(path):
+    """Raise PlaintextRejected for an unencrypted file while encryption is
+    enabled (and not migrating)"""
+    if not accepts_plaintext():
+        raise PlaintextRejected(f'{path} is not encrypted')
+
+
+def is_readable_file(path):
+    """Whether a stored file may be read under the current policy"""
+    return accepts_plaintext() or is_encrypted_file(path)
+
+
+class DecryptingReader:
+    """Seekable, iterable view of the plaintext of an encrypted file.
+
+    Iteration yields plaintext one chunk at a time starting at the current
+    position, decrypting only the chunks that are actually consumed. This
+    lets Werkzeug's range handling seek straight to the requested offset."""
+
+    def __init__(self, path):
+        if _aead is None:
+            raise RuntimeError(f'{path} is encrypted but FACE_ENCRYPTION_KEY is not set')
+        self._file = open(path, 'rb')
+        try:
+            self._header = self._file.read(HEADER.size)
+            magic, self.chunk_size, self._prefix = HEADER.unpack(self._header)
+            if magic != MAGIC:
+                raise ValueError(f'{path} is not an encrypted image')
+            sealed_size = os.fstat(self._file.fileno()).st_size - HEADER.size
+            sealed_chunk = self.chunk_size + TAG_SIZE
+            self.chunk_count = max(1, -(-sealed_size // sealed_chunk))
+            self.size = sealed_size - self.chunk_count * TAG_SIZE
+        except Exception:
+            self._file.close()
+            raise
+        self._position = 0
+
+    def seekable(self):
+        return True
+
+    def seek(self, position):
+        self._position = max(0, min(position, self.size))
+        return self._position
+
+    def tell(self):
+        return self._position
+
+    def read_chunk(self, index):
+        """Decrypt and return chunk `index`; raises InvalidTag on tampering"""
+        self._file.seek(HEADER.size + index * (self.chunk_size + TAG_SIZE))
+        sealed = self._file.read(self.chunk_size + TAG_SIZE)
+        last = index == self.chunk_count - 1
+        return _aead.decrypt(_nonce(self._prefix, index), sealed, _aad(self._header, last))
+
+    def read(self):
+        """Decrypt everything from the current position to the end"""
+        return b''.join(self)
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        if self._position >= self.size:
+            raise StopIteration()
+        index, offset = divmod(self._position, self.chunk_size)
+        chunk = self.read_chunk(index)[offset:]
+        self._position += len(chunk)
+        return chunk
+
+    def close(self):
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def read_file(path):
+    """Return the plaintext of a stored file, decrypting it if needed"""
+    if not is_encrypted_file(path):
+        check_plaintext_file(path)
+        with open(path, 'rb') as f:
+            return f.read()
+    with DecryptingReader(path) as reader:
+        return reader.read()
@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+"""
+Versioned on-disk format of the gallery index
+
+The gallery snapshot saved at shutdown is a single file of named arrays
+(template vectors, ids, hashes, coarse codes, IVF lists and centroids)
+laid out so it can be memory-mapped and used in place: opening it reads
+only the header and section table, and each array is a view of the
+mapping, paged in by the kernel as the search touches it.
+
+On-disk layout (all integers little-endian):
+
+    header   magic b'FIDX' | major u16 | minor u16 | sections u32 |
+             entry_size u32 | table_offset u64 | file_size u64 | 32 bytes 0
+    table    one entry_size (64-byte) entry per section:
+             name 16 bytes | dtype 8 bytes | ndim u32 | crc32 u32 |
+             offset u64 | nbytes u64 | shape 2 x u64
+    sections array data, C order, each starting on an ALIGNMENT boundary
+
+Names and dtypes (numpy dtype strings such as '<f4') are ASCII, padded
+with NUL bytes. The 'meta' section holds UTF-8 JSON (model name, counts).
+
+Validation is lazy: opening checks the header and that every section lies
+inside the file, and a section's CRC-32 is checked the first time it is
+read. Checking a section reads all of it, so a reader that wants the
+mapping paged in on demand takes the array with verify=False and checks
+it later (the server does so in the background).
+
+Versions: 1 is the original npz snapshot (read and written for
+conversion), 2 is this layout. Readers reject another major version and
+ignore sections they do not know, so minor versions can add sections (an
+ANN graph, say) without breaking older readers.
+
+    python index_file.py inspect gallery_snapshot.idx [--verify]
+    python index_file.py convert gallery_snapshot.npz gallery_snapshot.idx
+"""
+
+import argparse
+import io
+import json
+import mmap
+import struct
+import sys
+import zlib
+
+import numpy as np
+
+MAGIC = b'FIDX'
+VERSION = (2, 0)
+LEGACY_VERSION = 1
+HEADER = struct.Struct('<4sHHIIQQ32x')
+ENTRY = struct.Struct('<16s8sII2Q2Q')
+MAX_DIMS = 2
+# Page-aligned sections can be mapped on their own and start on a cache
+# line, as SIMD loads prefer
+ALIGNMENT = 4096
+
+
+class IndexFormatError(ValueError):
+    """The file is not a readable gallery index"""
+
+
+def _aligned(offset):
+    return -(-offset // ALIGNMENT) * ALIGNMENT
+
+
+def _bytes(array):
+    return memoryview(array.reshape(-1).view(np.uint8))
+
+
+def _crc32(view):
+    # zlib.crc32 takes at most 4 GB on some builds; feed it in steps
+    crc = 0
+    for start in range(0, len(view), 1 << 30):
+        crc = zlib.crc32(view[start:start + (1 << 30)], crc)
+    return crc
+
+
+def _pad(text, size):
+    encoded = text.encode('ascii')
+    if len(encoded) > size:
+        raise ValueError(f'{text!r} is longer than {size} bytes')
+    return encoded
+
+
+def encode(arrays, meta=None):
+    """Serialize a dict of arrays (at most 2-d) and a JSON-able `meta` dict
+    into the current format. Returns the file as a list of byte blocks."""
+    sections = {'meta': np.frombuffer(json.dumps(meta or {}).encode(), dtype=np.uint8)}
+    for name, array in arrays.items():
+        array = np.ascontiguousarray(array)
+        if array.ndim > MAX_DIMS or array.dtype.hasobject:
+            raise ValueError(f'Section {name} cannot be stored ({array.dtype}, {array.ndim}-d)')
+        sections[name] = array
+
+    table_offset = HEADER.size
+    offset = _aligned(table_offset + ENTRY.size * len(sections))
+    entries, layout = [], []
+    for name, array in sections.items():
+        shape = tuple(array.shape) + (0,) * (MAX_DIMS - array.ndim)
+        entries.append(ENTRY.pack(_pad(name, 16), _pad(array.dtype.str, 8), array.ndim, _crc32(_bytes(array)),
+                                  offset, array.nbytes, *shape))
+        layout.append((offset, array))
+        offset = _aligned(offset + array.nbytes)
+    file_size = layout[-1][0] + layout[-1][1].nbytes
+
+    head = HEADER.pack(MAGIC, *VERSION, len(sections), ENTRY.size, table_offset, file_size) + b''.join(entries)
+    blocks, position = [head], len(head)
+    for offset, array in layout:
+        blocks.append(bytes(offset - position))
+        blocks.append(_bytes(array))
+        position = offset + array.nbytes
+    return blocks
+
+
+def encode_legacy(arrays, meta=None):
+    """Serialize into the version 1 npz snapshot"""
+    buffer = io.BytesIO()
+    np.savez(buffer, model_name=(meta or {}).get('model_name', ''), **arrays)
+    return [buffer.getvalue()]
+
+
+class Section:
+    __slots__ = ('name', 'dtype', 'shape', 'offset', 'nbytes', 'crc32')
+
+    def __init__(self, name, dtype, shape, offset, nbytes, crc32):
+        self.name, self.dtype, self.shape = name, dtype, shape
+        self.offset, self.nbytes, self.crc32 = offset, nbytes, crc32
+
+
+class IndexFile:
+    """Read-only view of an index file; `buffer` is a mapping or bytes.
+    Use IndexFile.open() for files and IndexFile.from_buffer() for
+    decrypted ones."""
+
+    def __init__(self, buffer, version, sections, meta, arrays=None):
+        self._buffer = buffer
+        self.version = version
+        self.sections = sections
+        self.meta = meta
+        self._arrays = dict(arrays or {})
+
+    @property
+    def mapped(self):
+        """Whether arrays view a memory mapping of the file"""
+        return isinstance(self._buffer, mmap.mmap)
+
+    @classmethod
+    def open(cls, path):
+        """Map a plaintext index file (or load a legacy npz one)"""
+        with open(path, 'rb') as f:
+            if f.read(len(MAGIC)) != MAGIC:
+                f.seek(0)
+                return cls.from_buffer(f.read())
+            f.seek(0, io.SEEK_END)
+            if f.tell() == 0:
+                raise IndexFormatError('Empty index file')
+            # The mapping outlives the descriptor, and a snapshot renamed
+            # over this one later leaves it intact
+            return cls.from_buffer(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+
+    @classmethod
+    def from_buffer(cls, buffer):
+        if bytes(buffer[:2]) == b'PK':
+            return cls._from_npz(buffer)
+        if len(buffer) < HEADER.size:
+            raise IndexFormatError('Truncated index header')
+        magic, major, minor, count, entry_size, table_offset, file_size = HEADER.unpack_from(buffer, 0)
+        if magic != MAGIC:
+            raise IndexFormatError('Not a gallery index file')
+        if major != VERSION[0]:
+            raise IndexFormatError(f'Unsupported index version {major}.{minor} (this build reads {VERSION[0]}.x)')
+        if entry_size < ENTRY.size or file_size > len(buffer) or table_offset + count * entry_size > len(buffer):
+            raise IndexFormatError('Truncated index file')
+
+        sections = {}
+        for index in range(count):
+            raw = ENTRY.unpack_from(buffer, table_offset + index * entry_size)
+            name = raw[0].rstrip(b'\0').decode('ascii')
+            try:
+                dtype = np.dtype(raw[1].rstrip(b'\0').decode('ascii'))
+            except TypeError:
+                raise IndexFormatError(f'Section {name} has an unknown dtype')
+            ndim, crc, offset, nbytes = raw[2:6]
+            if ndim > MAX_DIMS:
+                raise IndexFormatError(f'Section {name} has {ndim} dimensions')
+            shape = tuple(raw[6:6 + ndim])
+            if offset % ALIGNMENT or offset + nbytes > file_size or int(np.prod(shape)) * dtype.itemsize != nbytes:
+                raise IndexFormatError(f'Section {name} is corrupt')
+            sections[name] = Section(name, dtype, shape, offset, nbytes, crc)
+
+        index_file = cls(buffer, (major, minor), sections, {})
+        if 'meta' in sections:
+            index_file.meta = json.loads(bytes(index_file.array('meta')).decode())
+        return index_file
+
+    @classmethod
+    def _from_npz(cls, buffer):
+        try:
+            with np.load(io.BytesIO(buffer)) as data:
+                arrays = {key: data[key] for key in data.files}
+        except Exception as e:
+            raise IndexFormatError(f'Unreadable npz snapshot: {e}')
+        meta = {'model_name': str(arrays.pop('model_name', ''))}
+        sections = {name: Section(name, array.dtype, array.shape, 0, array.nbytes, None)
+                    for name, array in arrays.items()}
+        return cls(None, LEGACY_VERSION, sections, meta, arrays)
+
+    def __contains__(self, name):
+        return name in self.sections
+
+    def array(self, name, verify=True):
+        """The section as a read-only array, viewing the file's buffer. Its
+        checksum is verified on first access unless `verify` is False."""
+        array = self._arrays.get(name)
+        if array is not None:
+            return array
+        section = self.sections.get(name)
+        if section is None:
+            raise KeyError(name)
+        data = memoryview(self._buffer)[section.offset:section.offset + section.nbytes]
+        if verify and _crc32(data) != section.crc32:
+            raise IndexFormatError(f'Section {name} fails its checksum')
+        array = np.frombuffer(data, dtype=section.dtype).reshape(section.shape)
+        if verify:
+            self._arrays[name] = array
+        return array
+
+    def get(self, name):
+        """The section's array, or None when the file has no such section"""
+        return self.array(name) if name in self.sections else None
+
+    def verify(self):
+        """Check every section's checksum; raises IndexFormatError"""
+        for name in self.sections:
+            self.array(name)
+
+    def arrays(self):
+        """Every section except 'meta' as a dict of arrays"""
+        return {name: self.array(name) for name in self.sections if name != 'meta'}
+
+
+def _version_label(version):
+    return str(version) if version == LEGACY_VERSION else '.'.join(map(str, version))
+
+
+def _read(path):
+    import image_crypto
+    if image_crypto.is_encrypted_file(path):
+        image_crypto.configure_from_env()
+        return IndexFile.from_buffer(image_crypto.read_file(path))
+    return IndexFile.open(path)
+
+
+def inspect(args):
+    index_file = _read(args.path)
+    if args.verify:
+        index_file.verify()
+    print(f"{args.path}: version {_version_label(index_file.version)}{', checksums ok' if args.verify else ''}")
+    for key, value in index_file.meta.items():
+        print(f"  {key}: {value}")
+    print(f"{'section':<16}{'dtype':>8}{'shape':>18}{'offset':>14}{'bytes':>14}")
+    for section in index_file.sections.values():
+        shape = 'x'.join(map(str, section.shape)) or 'scalar'
+        print(f"{section.name:<16}{section.dtype.str:>8}{shape:>18}{section.offset:>14}{section.nbytes:>14}")
+    return 0
+
+
+def convert(args):
+    import image_crypto
+    index_file = _read(args.source)
+    index_file.verify()
+    arrays, meta = index_file.arrays(), dict(index_file.meta)
+    if args.version == LEGACY_VERSION:
+        blocks = encode_legacy(arrays, meta)
+    else:
+        meta.setdefault('templates', len(arrays.get('template_ids', ())))
+        blocks = encode(arrays, meta)
+    data = b''.join(blocks)
+    # Encrypted when FACE_ENCRYPTION_KEY is set, like the server's snapshots
+    if image_crypto.configure_from_env():
+        image_crypto.write_file(args.target, data)
+    else:
+        with open(args.target, 'wb') as f:
+            f.write(data)
+    print(f"✅ {args.source} (version {_version_label(index_file.version)}) -> {args.target} (version {args.version})")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    inspect_parser = sub.add_parser('inspect', help='print the header and section table')
+    inspect_parser.add_argument('path')
+    inspect_parser.add_argument('--verify', action='store_true', help='check every section checksum')
+    inspect_parser.set_defaults(func=inspect)
+
+    convert_parser = sub.add_parser('convert', help='rewrite a snapshot in another format version')
+    convert_parser.add_argument('source')
+    convert_parser.add_argument('target')
+    convert_parser.add_argument('--version', type=int, choices=(LEGACY_VERSION, VERSION[0]), default=VERSION[0])
+    convert_parser.set_defaults(func=convert)
+
+    args = parser.parse_args()
+    try:
+        return args.func(args)
+    except (IndexFormatError, OSError, RuntimeError) as e:
+        print(f"❌ {e}")
+        return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
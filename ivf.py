@@ -0,0 +1,77 @@
+"""
+Inverted-file (IVF) index over gallery templates
+
+Templates are clustered around `lists` centroids (spherical mini-batch
+k-means, see kmeans.py), and every template belongs to the list of its
+closest centroid. A query scores the centroids first and then only the templates
+of the lists it probes, so a search touches a fraction of the gallery
+with no per-template overhead beyond a list id.
+
+How many lists a query probes adapts to how clear-cut it is: every list
+whose centroid scores within `margin` of the best one, bounded by
+nprobe_min and nprobe_max. A probe close to a single centroid (a clear
+gap to the runner-up) scans few lists; one between several centroids,
+where the true match may sit in any of them, scans more.
+"""
+
+import numpy as np
+
+import kmeans
+
+# Fewer rows per list than this leaves centroids poorly placed; smaller
+# galleries stay on the exact scan
+MIN_ROWS_PER_LIST = 39
+
+
+def default_lists(count):
+    """Number of lists for a gallery of `count` templates: about sqrt(count)"""
+    return max(1, int(np.sqrt(count)))
+
+
+def assign(vectors, centroids, pool=None):
+    """Index of the closest centroid of every row"""
+    return kmeans.assign(vectors, centroids, pool=pool)
+
+
+def train_centroids(vectors, lists, seed=0, pool=None):
+    """Return (lists, dim) unit centroids and the trainer's timing stats"""
+    return kmeans.train(vectors, lists, pool=pool, seed=seed)
+
+
+def layout(list_ids, lists):
+    """Posting lists as (rows, offsets): `rows[offsets[i]:offsets[i + 1]]`
+    are the gallery rows of list i, in gallery order"""
+    rows = np.argsort(list_ids, kind='stable').astype(np.int64)
+    offsets = np.searchsorted(list_ids[rows], np.arange(lists + 1))
+    return rows, offsets
+
+
+def layout_append(rows, offsets, start, list_ids):
+    """Posting lists after appending gallery rows start, start + 1, ... with
+    `list_ids`: each new row goes to the end of its list. Sorts only the
+    new rows."""
+    order = np.argsort(list_ids, kind='stable')
+    new_lists = list_ids[order]
+    rows = np.insert(rows, offsets[new_lists + 1], start + order)
+    offsets = offsets + np.searchsorted(new_lists, np.arange(len(offsets)))
+    return rows, offsets
+
+
+def layout_remove(rows, offsets, list_ids, keep):
+    """Posting lists after keeping only the gallery rows where `keep`;
+    `list_ids` are those of the rows before removal"""
+    renumbered = np.cumsum(keep) - 1
+    rows = renumbered[rows[keep[rows]]]
+    removed = np.bincount(list_ids[~keep], minlength=len(offsets) - 1)
+    offsets = offsets - np.concatenate([[0], np.cumsum(removed)])
+    return rows, offsets
+
+
+def probe_lists(centroid_scores, nprobe_min, nprobe_max, margin):
+    """Lists to scan for one query: every list whose centroid scores within
+    `margin` of the best, at least nprobe_min and at most nprobe_max"""
+    limit = max(1, min(nprobe_max, len(centroid_scores)))
+    top = np.argpartition(centroid_scores, -limit)[-limit:]
+    top = top[np.argsort(centroid_scores[top])[::-1]]
+    count = int(np.sum(centroid_scores[top] >= centroid_scores[top[0]] - margin))
+    return top[:min(max(count, nprobe_min), limit)]
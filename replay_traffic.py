@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""
+Replay captured Face Recognition Server traffic against a local server
+
+Capture on the source server:
+    CAPTURE_FILE=traffic.jsonl python app.py
+
+Replay at the original pace, or scaled (2.0 = twice as fast):
+    python replay_traffic.py traffic.jsonl --base-url http://localhost:5000 --rate 2.0
+
+Captured payloads are anonymized (see traffic_capture.py), so face images
+are rebuilt with test_server.create_test_image at the recorded dimensions
+and identities are re-derived from the name tokens. Everything is seeded,
+so two replays of one capture send identical requests on the same
+schedule. The report compares replay latency per route with the latency
+recorded at capture time. Captured latency is measured inside the app and
+replay latency at the client, so compare replays of the same capture
+against each other (before/after a change) rather than against the
+captured column alone.
+"""
+
+import argparse
+import json
+import random
+import sys
+import threading
+import time
+import uuid
+from concurrent.futures import ThreadPoolExecutor
+
+import requests
+
+from test_server import create_test_image, image_to_base64
+
+
+def load_capture(path, limit=None):
+    records = []
+    with open(path, encoding='utf-8') as f:
+        for line in f:
+            line = line.strip()
+            if line:
+                records.append(json.loads(line))
+            if limit and len(records) >= limit:
+                break
+    records.sort(key=lambda record: record['ts'])
+    return records
+
+
+class PayloadBuilder:
+    """Rebuild request bodies from anonymized captures, deterministically"""
+
+    def __init__(self, records, seed):
+        self.rng = random.Random(seed)
+        self.run_id = uuid.UUID(int=random.Random(seed).getrandbits(128)).hex[:8]
+        self.identities = sorted({
+            record['payload']['name'] for record in records
+            if record.get('payload') and record['payload'].get('name')
+        }) or ['anon-replay']
+        self._images = {}
+
+    def _image(self, label, description):
+        size = (description.get('width', 640), description.get('height', 480))
+        key = (label, size)
+        if key not in self._images:
+            self._images[key] = image_to_base64(create_test_image(label, size))
+        return self._images[key]
+
+    def build(self, record):
+        payload = record.get('payload')
+        if payload is None:
+            return None
+        body = dict(payload)
+        # Probes without a name show one of the captured identities
+        label = body.get('name') or self.rng.choice(self.identities)
+        for key, value in payload.items():
+            if isinstance(value, dict) and 'image' in value:
+                description = value['image']
+                body[key] = 'invalid' if description.get('invalid') else self._image(label, description)
+        if body.get('email'):
+            # Emails are UNIQUE; keep replays of one capture from colliding
+            body['email'] = body['email'].replace('@', f'+{self.run_id}@', 1)
+        return body
+
+
+def percentile(values, fraction):
+    if not values:
+        return float('nan')
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(round(fraction * (len(ordered) - 1))))]
+
+
+def replay(records, base_url, rate, concurrency, seed):
+    builder = PayloadBuilder(records, seed)
+    # Build every body before the clock starts so image encoding does not
+    # distort the schedule
+    prepared = [(record, builder.build(record)) for record in records]
+
+    results = []
+    results_lock = threading.Lock()
+    session = requests.Session()
+    adapter = requests.adapters.HTTPAdapter(pool_connections=concurrency, pool_maxsize=concurrency)
+    session.mount('http://', adapter)
+    session.mount('https://', adapter)
+
+    def send(record, body, due):
+        started = time.perf_counter()
+        url = base_url.rstrip('/') + record['path']
+        if record.get('query'):
+            url += '?' + record['query']
+        try:
+            response = session.request(record['method'], url, json=body, timeout=60)
+            status = response.status_code
+        except requests.RequestException:
+            status = None
+        elapsed_ms = (time.perf_counter() - started) * 1000
+        with results_lock:
+            results.append({
+                'route': record.get('route') or record['path'],
+                'recorded_ms': record['latency_ms'],
+                'replay_ms': elapsed_ms,
+                'lag_ms': (started - due) * 1000,
+                'recorded_status': record['status'],
+                'status': status
+            })
+
+    first_ts = records[0]['ts']
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=concurrency) as pool:
+        for record, body in prepared:
+            due = start + (record['ts'] - first_ts) / rate
+            delay = due - time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+            pool.submit(send, record, body, due)
+    return results, time.perf_counter() - start
+
+
+def report(results, wall_seconds):
+    routes = {}
+    for result in results:
+        routes.setdefault(result['route'], []).append(result)
+
+    header = (f"{'route':<42}{'n':>6}{'rec p50':>9}{'rep p50':>9}{'Δp50':>9}"
+              f"{'rec p95':>9}{'rep p95':>9}{'Δp95':>9}{'status≠':>9}")
+    print(header)
+    print('-' * len(header))
+    for route, rows in sorted(routes.items()):
+        recorded = [row['recorded_ms'] for row in rows]
+        replayed = [row['replay_ms'] for row in rows]
+        mismatched = sum(row['status'] != row['recorded_status'] for row in rows)
+        rec50, rep50 = percentile(recorded, 0.5), percentile(replayed, 0.5)
+        rec95, rep95 = percentile(recorded, 0.95), percentile(replayed, 0.95)
+        print(f"{route:<42}{len(rows):>6}{rec50:>9.1f}{rep50:>9.1f}{rep50 - rec50:>+9.1f}"
+              f"{rec95:>9.1f}{rep95:>9.1f}{rep95 - rec95:>+9.1f}{mismatched:>9}")
+
+    lags = [row['lag_ms'] for row in results]
+    print(f"\n{len(results)} requests in {wall_seconds:.1f}s "
+          f"({len(results) / wall_seconds:.1f} req/s); scheduling lag p50 {percentile(lags, 0.5):.1f}ms, "
+          f"p99 {percentile(lags, 0.99):.1f}ms")
+    if percentile(lags, 0.99) > 50:
+        print("⚠️ Replay fell behind schedule; raise --concurrency or lower --rate for faithful timing")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('capture', help='JSONL file written with CAPTURE_FILE')
+    parser.add_argument('--base-url', default='http://localhost:5000')
+    parser.add_argument('--rate', type=float, default=1.0, help='speed-up factor over the captured pace')
+    parser.add_argument('--concurrency', type=int, default=16)
+    parser.add_argument('--limit', type=int, help='replay only the first N requests')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--output', help='write per-request results as JSON')
+    args = parser.parse_args()
+
+    records = load_capture(args.capture, args.limit)
+    if not records:
+        print("Capture file is empty")
+        return 1
+
+    print(f"🔁 Replaying {len(records)} requests against {args.base_url} at {args.rate}x")
+    results, wall_seconds = replay(records, args.base_url, args.rate, args.concurrency, args.seed)
+    report(results, wall_seconds)
+
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8') as f:
+            json.dump(results, f, indent=2)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,187 @@
+"""
+Atomic writer for stored files, with optional background batching
+
+Enrolled images, derivatives, audit snapshots and gallery snapshots go
+through one StorageWriter. Each file goes to a temporary name and is
+renamed into place, so readers never see a partial file. Durable writes
+are flushed to disk, and their directory is synced after the rename, so an
+enrollment that has committed cannot lose its image in a crash.
+
+By default each write runs in the calling thread. With `max_batch` > 0 a
+writer thread takes queued writes in batches instead: every file of a
+batch is written and flushed before any is renamed, and each directory is
+synced once per batch, so concurrent enrollments share the flush latency
+(group commit). That only pays off where fsync costs milliseconds; where
+it is cheap, the hand-off to the thread makes writes slower.
+"""
+
+import logging
+import os
+import queue
+import threading
+import uuid
+from concurrent.futures import Future
+
+logger = logging.getLogger(__name__)
+
+_sync_data = getattr(os, 'fdatasync', os.fsync)
+
+
+class _Write:
+    __slots__ = ('path', 'blocks', 'mode', 'durable', 'future', 'tmp_path', 'size')
+
+    def __init__(self, path, blocks, mode, durable):
+        self.path = path
+        self.blocks = blocks
+        self.mode = mode
+        self.durable = durable
+        self.future = Future()
+        self.tmp_path = None
+        self.size = 0
+
+
+class StorageWriter:
+    def __init__(self, fsync=True, max_batch=0, queue_size=1024):
+        """`fsync=False` skips every flush (tests, throwaway data); writes
+        are still atomic. `max_batch` > 0 starts the batching writer
+        thread; 0 writes each file in the calling thread."""
+        self.fsync = fsync
+        self.max_batch = max_batch
+        self._queue = queue.Queue(maxsize=queue_size)
+        self._lock = threading.Lock()
+        self._submit_lock = threading.Lock()
+        self._closed = False
+        self._counts = {'files': 0, 'bytes': 0, 'batches': 0, 'failed': 0}
+        self._thread = None
+        if max_batch > 0:
+            self._thread = threading.Thread(target=self._run, name='storage-writer', daemon=True)
+            self._thread.start()
+
+    def submit(self, path, blocks, mode=0o644, durable=True):
+        """Write `blocks` (an iterable of bytes) to `path`. Returns a Future
+        that resolves once the file is in place. With the writer thread the
+        write is queued, and this blocks while the queue is full so callers
+        feel disk back-pressure. Raises RuntimeError once closed."""
+        write = _Write(path, blocks, mode, durable and self.fsync)
+        if self._thread is None:
+            if self._closed:
+                raise RuntimeError("Storage writer is closed")
+            self._write_batch([write])
+            return write.future
+        # The check and the put happen under one lock so no write can land
+        # behind close()'s stop marker
+        with self._submit_lock:
+            if self._closed:
+                raise RuntimeError("Storage writer is closed")
+            self._queue.put(write)
+        return write.future
+
+    def write(self, path, blocks, mode=0o644, durable=True):
+        self.submit(path, blocks, mode, durable).result()
+
+    def flush(self):
+        """Wait until every queued write has completed"""
+        self._queue.join()
+
+    def close(self):
+        """Finish queued writes and stop the writer thread. Later submits
+        raise RuntimeError."""
+        with self._submit_lock:
+            if self._closed:
+                return
+            self._closed = True
+            if self._thread is not None:
+                self._queue.put(None)
+        if self._thread is not None:
+            self._thread.join()
+
+    def stats(self):
+        with self._lock:
+            stats = dict(self._counts)
+        stats['pending'] = self._queue.qsize()
+        stats['avg_batch'] = round(stats['files'] / max(stats['batches'], 1), 2)
+        return stats
+
+    def _run(self):
+        while True:
+            first = self._queue.get()
+            if first is None:
+                self._queue.task_done()
+                return
+            batch = [first]
+            stop = False
+            while len(batch) < self.max_batch:
+                try:
+                    write = self._queue.get_nowait()
+                except queue.Empty:
+                    break
+                if write is None:
+                    stop = True
+                    break
+                batch.append(write)
+            self._write_batch(batch)
+            for _ in range(len(batch) + stop):
+                self._queue.task_done()
+            if stop:
+                return
+
+    def _write_batch(self, batch):
+        # Write and flush every file, then publish them all, then sync each
+        # directory once
+        written = []
+        for write in batch:
+            try:
+                self._write_tmp(write)
+                written.append(write)
+            except Exception as e:
+                self._fail(write, e)
+
+        directories = set()
+        published = []
+        for write in written:
+            try:
+                os.replace(write.tmp_path, write.path)
+                published.append(write)
+                if write.durable:
+                    directories.add(os.path.dirname(os.path.abspath(write.path)))
+            except Exception as e:
+                self._fail(write, e)
+
+        for directory in directories:
+            try:
+                fd = os.open(directory, os.O_RDONLY)
+                try:
+                    os.fsync(fd)
+                finally:
+                    os.close(fd)
+            except OSError as e:
+                logger.warning(f"Could not sync directory {directory}: {e}")
+
+        with self._lock:
+            self._counts['batches'] += 1
+            self._counts['files'] += len(published)
+            self._counts['bytes'] += sum(write.size for write in published)
+        for write in published:
+            write.future.set_result(write.path)
+
+    def _write_tmp(self, write):
+        write.tmp_path = f"{write.path}.{uuid.uuid4().hex[:8]}.tmp"
+        fd = os.open(write.tmp_path, os.O_WRONLY | os.O_CREAT | os.O_EXCL, write.mode)
+        try:
+            for block in write.blocks:
+                view = memoryview(block)
+                while view:
+                    view = view[os.write(fd, view):]
+                write.size += len(block)
+            if write.durable:
+                _sync_data(fd)
+        finally:
+            os.close(fd)
+
+    def _fail(self, write, error):
+        logger.error(f"Error writing {write.path}: {error}")
+        if write.tmp_path and os.path.exists(write.tmp_path):
+            os.remove(write.tmp_path)
+        with self._lock:
+            self._counts['failed'] += 1
+        write.future.set_exception(error)
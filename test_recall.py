@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""
+Recall regression test for the gallery index
+
+Builds every approximate search path (coarse binary shortlist, IVF) over
+one gallery with the index settings from config.toml and the environment,
+runs the same probes through them and through the exact scan, and checks
+recall -- the share of the exact top users the index also returns. Every
+index must reach REQUIRED_RECALL both at k=1, the single match the server
+searches for, and at --k. Rank-1 identification of the genuine probes and
+per-probe latency are reported next to it, so a change to index
+parameters shows its speed/recall trade-off.
+
+Usage:
+    python test_recall.py [--identities 100000 --probes 500 --k 10 --min-recall 0.99]
+    python test_recall.py --arrays gallery_100k/      # from generate_gallery.py --arrays
+
+Exits with status 1 when any index is below the bar at either k.
+"""
+
+import argparse
+import os
+import sys
+import time
+
+import numpy as np
+
+import config as server_config
+from execution import WorkStealingPool, physical_core_count
+from face_index import Gallery
+from generate_gallery import SyntheticGallery
+
+# Approximate search paths under test
+INDEXES = ('coarse', 'ivf')
+# Share of the exact matches an index must find, at k=1 and at --k, unless
+# --min-recall is given: an index may miss at most one identification in 20
+REQUIRED_RECALL = 0.95
+# Code width of the coarse index when the server has coarse codes off
+COARSE_BITS = 256
+
+
+def synthetic_gallery(args):
+    """Templates, their user ids, probes and the probes' user ids (-1 for
+    impostors) from a seeded synthetic gallery"""
+    synthetic = SyntheticGallery(args.identities, args.dim, seed=args.seed)
+    blocks = list(synthetic.blocks(50000))
+    vectors = np.concatenate([block for _, block in blocks])
+    user_ids = np.concatenate([identities for identities, _ in blocks]) + 1
+    probes, labels = synthetic.probes(args.probes, args.impostor_fraction)
+    return vectors, user_ids, probes, np.where(labels >= 0, labels + 1, -1)
+
+
+def local_gallery(args):
+    """The same arrays from a generate_gallery.py --arrays directory"""
+    load = lambda name: np.load(os.path.join(args.arrays, f'{name}.npy'), mmap_mode='r')
+    if not os.path.exists(os.path.join(args.arrays, 'probe_vectors.npy')):
+        raise SystemExit(f"❌ {args.arrays} has no probes; generate it with --probes")
+    probes = np.asarray(load('probe_vectors'))[:args.probes]
+    return np.asarray(load('vectors')), np.asarray(load('user_ids')), probes, \
+        np.asarray(load('probe_user_ids'))[:len(probes)]
+
+
+def build_gallery(index, vectors, user_ids, settings, pool):
+    """A gallery searched by `index` ('exact', 'coarse' or 'ivf')"""
+    gallery = Gallery(shortlist_factor=settings['index.shortlist_factor'],
+                      coarse_bits=0 if index == 'exact' else settings['index.coarse_bits'] or COARSE_BITS,
+                      coarse_min_templates=0 if index == 'coarse' else len(vectors) + 1,
+                      coarse_candidates=settings['index.coarse_candidates'],
+                      coarse_fraction=settings['index.coarse_fraction'],
+                      ivf_nprobe_min=settings['index.ivf_nprobe_min'],
+                      ivf_nprobe_max=settings['index.ivf_nprobe_max'],
+                      ivf_margin=settings['index.ivf_margin'])
+    gallery.load(np.arange(1, len(vectors) + 1), user_ids, vectors)
+    if index == 'ivf' and not gallery.build_ivf(settings['index.ivf_lists'], pool=pool):
+        return None
+    return gallery
+
+
+def run_probes(gallery, probes, k):
+    """Search probes one at a time, as a kiosk request does. Returns the
+    top-k user ids per probe and the per-probe latencies in ms."""
+    users, latencies = [], np.empty(len(probes))
+    for index, probe in enumerate(probes):
+        started = time.perf_counter()
+        matches = gallery.search(probe[None], k)[0]
+        latencies[index] = (time.perf_counter() - started) * 1000
+        users.append([match.user_id for match in matches])
+    return users, latencies
+
+
+def recall_at_k(found, exact):
+    """Mean share of each probe's exact top-k users that the index found"""
+    return float(np.mean([len(set(a) & set(b)) / len(b) for a, b in zip(found, exact) if b]))
+
+
+def rank1(found, labels):
+    """Share of genuine probes whose top match is the right user"""
+    return float(np.mean([len(users) > 0 and users[0] == label
+                          for users, label in zip(found, labels) if label >= 0]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--identities', type=int, default=100000)
+    parser.add_argument('--dim', type=int, default=512)
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--arrays', help='generate_gallery.py --arrays directory instead of a synthetic gallery')
+    parser.add_argument('--probes', type=int, default=500)
+    parser.add_argument('--impostor-fraction', type=float, default=0.1)
+    parser.add_argument('--k', type=int, default=10)
+    parser.add_argument('--min-recall', type=float, default=REQUIRED_RECALL,
+                        help=f'recall@1 and recall@k every index must reach (default: {REQUIRED_RECALL})')
+    parser.add_argument('--index', choices=INDEXES, nargs='*', help='indexes to test (default: all)')
+    args = parser.parse_args()
+
+    settings = server_config.load()
+    started = time.perf_counter()
+    vectors, user_ids, probes, labels = local_gallery(args) if args.arrays else synthetic_gallery(args)
+    print(f"📊 {len(vectors)} templates, {len(probes)} probes ({int(np.sum(labels < 0))} impostors), "
+          f"k={args.k}, ready in {time.perf_counter() - started:.1f}s")
+
+    pool = WorkStealingPool('recall', physical_core_count())
+    exact_gallery = build_gallery('exact', vectors, user_ids, settings, pool)
+    exact_top1, exact_ms = run_probes(exact_gallery, probes, 1)
+    exact, _ = run_probes(exact_gallery, probes, args.k)
+    print(f"{'index':<8}{'recall@1':>10}{f'recall@{args.k}':>10}{'rank-1':>8}{'p50 ms':>8}{'p99 ms':>8}"
+          f"{'speedup':>9}{'rows/query':>12}")
+    print(f"{'exact':<8}{1.0:>10.3f}{1.0:>10.3f}{rank1(exact_top1, labels):>8.3f}{np.median(exact_ms):>8.2f}"
+          f"{np.percentile(exact_ms, 99):>8.2f}{1.0:>8.1f}x{len(vectors):>12}")
+
+    failures = []
+    for index in args.index or INDEXES:
+        started = time.perf_counter()
+        gallery = build_gallery(index, vectors, user_ids, settings, pool)
+        if gallery is None:
+            print(f"{index:<8} skipped: gallery too small for an index")
+            continue
+        build_s = time.perf_counter() - started
+        # Latency and rows scanned are those of the server's k=1 search
+        found_top1, found_ms = run_probes(gallery, probes, 1)
+        rows_scored = gallery.index_stats()['avg_rows_scored']
+        found, _ = run_probes(gallery, probes, args.k)
+        recalls = {1: recall_at_k(found_top1, exact_top1), args.k: recall_at_k(found, exact)}
+        print(f"{index:<8}{recalls[1]:>10.3f}{recalls[args.k]:>10.3f}{rank1(found_top1, labels):>8.3f}"
+              f"{np.median(found_ms):>8.2f}{np.percentile(found_ms, 99):>8.2f}"
+              f"{np.median(exact_ms) / np.median(found_ms):>8.1f}x{rows_scored:>12.0f}   (built in {build_s:.1f}s)")
+        failures += [f"{index} recall@{k} {recall:.3f} < {args.min_recall}"
+                     for k, recall in recalls.items() if recall < args.min_recall]
+    pool.shutdown()
+
+    if failures:
+        for failure in failures:
+            print(f"❌ {failure}")
+        return 1
+    print(f"✅ Every index reaches recall {args.min_recall} at k=1 and k={args.k}")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
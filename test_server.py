@@ -7,6 +7,7 @@ import requests
 import base64
 import json
 import os
+import time
 from PIL import Image, ImageDraw
 
 def create_test_image(name, size=(640, 480)):
@@ -149,6 +150,232 @@ def test_server(base_url="http://localhost:5000"):
     except Exception as e:
         print(f"❌ Error getting history: {e}")
     
+    # Test 6: Face thumbnails and crops
+    print("\n6. Testing face thumbnails...")
+    if registered_users:
+        try:
+            user_id = registered_users[0]['user_id']
+            for variant in ('thumbnail', 'crop'):
+                response = requests.get(f"{base_url}/api/users/{user_id}/face/{variant}",
+                                        headers={"Accept": "image/webp,*/*"})
+                if response.status_code == 200:
+                    print(f"✅ {variant}: {response.headers['Content-Type']}, {len(response.content)} bytes, "
+                          f"Cache-Control: {response.headers.get('Cache-Control')}")
+                    cached = requests.get(f"{base_url}/api/users/{user_id}/face/{variant}",
+                                          headers={"Accept": "image/webp,*/*", "If-None-Match": response.headers.get('ETag', '')})
+                    if cached.status_code != 304:
+                        print(f"❌ Conditional {variant} request returned {cached.status_code}")
+                else:
+                    print(f"❌ Failed to get {variant}: {response.status_code}")
+        except Exception as e:
+            print(f"❌ Error getting face derivatives: {e}")
+    
+    # Test 7: Stored face image retrieval
+    print("\n7. Testing stored face image retrieval...")
+    if registered_users:
+        try:
+            url = f"{base_url}/api/users/{registered_users[0]['user_id']}/face"
+            full = requests.get(url)
+            head = requests.head(url)
+            partial = requests.get(url, headers={"Range": "bytes=0-99"})
+            if full.status_code == 200 and head.status_code == 200 and partial.status_code == 206:
+                print(f"✅ Image: {len(full.content)} bytes, HEAD Content-Length: {head.headers.get('Content-Length')}, "
+                      f"Range: {partial.headers.get('Content-Range')}")
+                if partial.content != full.content[:100]:
+                    print("❌ Range response does not match the start of the file")
+            else:
+                print(f"❌ Image retrieval failed: GET {full.status_code}, HEAD {head.status_code}, Range {partial.status_code}")
+        except Exception as e:
+            print(f"❌ Error retrieving stored image: {e}")
+    
+    # Test 8: Audit snapshots (only recorded when the server runs with AUDIT_SNAPSHOTS=1)
+    print("\n8. Testing audit snapshots...")
+    try:
+        history = requests.get(f"{base_url}/api/history").json()['history']
+        sampled = [attempt for attempt in history if attempt.get('has_snapshot')]
+        if not sampled:
+            print("⚠️ No sampled attempts (audit snapshots disabled or not sampled)")
+        else:
+            time.sleep(0.2)  # snapshots are written asynchronously
+            response = requests.get(f"{base_url}/api/history/{sampled[0]['id']}/snapshot")
+            if response.status_code == 200:
+                print(f"✅ Snapshot for attempt {sampled[0]['id']}: {len(response.content)} bytes")
+            else:
+                print(f"❌ Failed to get snapshot: {response.status_code}")
+    except Exception as e:
+        print(f"❌ Error getting audit snapshot: {e}")
+    
+    # Test 9: Multi-face recognition
+    print("\n9. Testing multi-face recognition...")
+    if registered_users:
+        try:
+            group = Image.new('RGB', (1280, 480), color='lightblue')
+            group.paste(create_test_image(test_users[0]["name"]), (0, 0))
+            group.paste(create_test_image(test_users[1]["name"]), (640, 0))
+            
+            response = requests.post(
+                f"{base_url}/api/auth/recognize/multi",
+                json={"face_image": image_to_base64(group)},
+                headers={"Content-Type": "application/json"}
+            )
+            
+            if response.status_code == 200:
+                result = response.json()
+                print(f"✅ {result['recognized_count']}/{result['count']} faces recognized")
+                for face in result['faces']:
+                    print(f"   - {face['user_name'] or 'Unknown'} at {face['box']} ({face['confidence']}% confidence)")
+            else:
+                print(f"❌ Multi-face recognition failed: {response.status_code}")
+                print(f"   Error: {response.text}")
+        except Exception as e:
+            print(f"❌ Error during multi-face recognition: {e}")
+    
+    # Test 10: Metrics
+    print("\n10. Testing metrics...")
+    try:
+        response = requests.get(f"{base_url}/api/metrics")
+        if response.status_code == 200:
+            result = response.json()
+            missing = [key for key in ('pools', 'storage', 'index', 'frame_gate') if key not in result]
+            pools = result.get('pools', {})
+            if missing or not {'inference', 'http', 'template_update'} <= pools.keys():
+                print(f"❌ Metrics are missing sections: {missing or sorted(pools)}")
+            elif registered_users and pools['inference']['completed'] == 0:
+                print("❌ Inference pool reports no completed tasks after recognitions")
+            elif result['index']['templates'] < len(registered_users):
+                print(f"❌ Index reports {result['index']['templates']} templates for {len(registered_users)} users")
+            else:
+                print(f"✅ Inference: {pools['inference']['completed']} tasks on {pools['inference']['threads']} threads, "
+                      f"index: {result['index']['type']} over {result['index']['templates']} templates")
+            
+            # Crowded frames under concurrent load: idle inference threads
+            # should steal the per-face subtasks
+            if registered_users:
+                from concurrent.futures import ThreadPoolExecutor
+                threads = pools['inference']['threads']
+                stolen = pools['inference']['stolen']
+                crowd = Image.new('RGB', (1280, 960), color='lightblue')
+                for index, position in enumerate(((0, 0), (640, 0), (0, 480), (640, 480))):
+                    crowd.paste(create_test_image(test_users[index % len(test_users)]["name"]), position)
+                crowd_base64 = image_to_base64(crowd)
+                with ThreadPoolExecutor(max(threads // 2, 1)) as clients:
+                    faces = list(clients.map(
+                        lambda _: requests.post(f"{base_url}/api/auth/recognize/multi",
+                                                json={"face_image": crowd_base64}).json().get('count', 0),
+                        range(4 * max(threads // 2, 1))))
+                stolen = requests.get(f"{base_url}/api/metrics").json()['pools']['inference']['stolen'] - stolen
+                if stolen > 0:
+                    print(f"✅ {stolen} subtasks stolen across {threads} inference threads under concurrent load")
+                elif threads < 2 or max(faces) < 2:
+                    print(f"⚠️ No stealing possible ({threads} inference threads, {max(faces)} faces detected per frame)")
+                else:
+                    print(f"❌ No subtasks stolen across {threads} inference threads under concurrent load")
+        else:
+            print(f"❌ Failed to get metrics: {response.status_code}")
+    except Exception as e:
+        print(f"❌ Error getting metrics: {e}")
+    
+    # Test 11: Empty-frame gate
+    print("\n11. Testing empty-frame gate...")
+    if registered_users:
+        try:
+            def gate_state():
+                metrics = requests.get(f"{base_url}/api/metrics").json()
+                history = requests.get(f"{base_url}/api/history", params={"limit": 10000}).json()
+                return metrics['frame_gate'], metrics['pools']['inference']['completed'], history['count']
+            
+            def recognize(image):
+                return requests.post(
+                    f"{base_url}/api/auth/recognize",
+                    json={"face_image": image_to_base64(image), "camera_id": "test-kiosk"},
+                    headers={"Content-Type": "application/json"}
+                )
+            
+            # A blank frame is answered from its thumbnail: no detection, and
+            # no history row (only frames the detector saw are recorded)
+            gate, inferences, attempts = gate_state()
+            response = recognize(Image.new('RGB', (640, 480), color='gray'))
+            after_gate, after_inferences, after_attempts = gate_state()
+            if response.status_code != 200 or response.json().get('error') != 'No face detected':
+                print(f"❌ Blank frame got {response.status_code}: {response.text}")
+            elif after_gate['skipped_flat'] != gate['skipped_flat'] + 1:
+                print(f"❌ Blank frame was not skipped by the gate: {after_gate}")
+            elif after_inferences != inferences:
+                print("❌ Blank frame reached the detector")
+            elif after_attempts != attempts:
+                print("❌ Blank frame wrote a login history row")
+            else:
+                print("✅ Blank frame answered without detection or a history row")
+            
+            # A face frame still goes through detection and is recorded
+            response = recognize(create_test_image(test_users[0]["name"]))
+            _, face_inferences, face_attempts = gate_state()
+            if response.status_code != 200 or not response.json().get('success'):
+                print(f"❌ Face frame after the gate got {response.status_code}: {response.text}")
+            elif face_inferences == after_inferences or face_attempts != after_attempts + 1:
+                print("❌ Face frame was not run through detection and recorded")
+            else:
+                print(f"✅ Face frame still recognized: {response.json()['user_name']}")
+            
+            # The same empty scene twice: the first frame is checked by the
+            # detector and becomes the camera's reference, the second is skipped
+            scene = Image.new('RGB', (640, 480), color='lightblue')
+            ImageDraw.Draw(scene).rectangle([100, 300, 540, 460], fill='saddlebrown')
+            first = recognize(scene)
+            gate, inferences, attempts = gate_state()
+            second = recognize(scene)
+            after_gate, after_inferences, after_attempts = gate_state()
+            if first.json().get('success') is not False or second.json().get('success') is not False:
+                print(f"❌ Empty scene was recognized: {first.text} {second.text}")
+            elif first.json().get('error') != 'No face detected':
+                print("⚠️ The detector sees a face in the empty scene (simplified detector), "
+                      "so the unchanged-scene check does not apply")
+            elif after_gate['skipped_unchanged'] != gate['skipped_unchanged'] + 1 or after_inferences != inferences:
+                print(f"❌ Repeated empty scene reached the detector: {after_gate}")
+            elif after_attempts != attempts:
+                print("❌ Repeated empty scene wrote a login history row")
+            else:
+                print("✅ Repeated empty scene answered without detection or a history row")
+        except Exception as e:
+            print(f"❌ Error testing the empty-frame gate: {e}")
+    
+    # Test 12: Region of interest
+    print("\n12. Testing region of interest...")
+    if registered_users:
+        try:
+            # The registered face on the left half of a wider frame
+            frame = Image.new('RGB', (1280, 480), color='white')
+            frame.paste(create_test_image(test_users[1]["name"]), (0, 0))
+            frame_base64 = image_to_base64(frame)
+            
+            def recognize(roi):
+                return requests.post(
+                    f"{base_url}/api/auth/recognize",
+                    json={"face_image": frame_base64, "roi": roi},
+                    headers={"Content-Type": "application/json"}
+                )
+            
+            response = recognize({"x": 0, "y": 0, "width": 640, "height": 480})
+            if response.status_code == 200 and response.json().get('success'):
+                if response.json()['user_name'] != test_users[1]["name"]:
+                    print(f"❌ ROI around {test_users[1]['name']} matched {response.json()['user_name']}")
+                else:
+                    print(f"✅ ROI around the face: {response.json()['user_name']} ({response.json()['confidence']}% confidence)")
+            elif response.status_code == 200:
+                print(f"⚠️ Face in the ROI not recognized: {response.json().get('error')}")
+            else:
+                print(f"❌ ROI around the face got {response.status_code}: {response.text}")
+            
+            for label, roi in (("malformed roi", {"x": "left", "y": 0}),
+                               ("roi outside the frame", {"x": 2000, "y": 0, "width": 100, "height": 100})):
+                response = recognize(roi)
+                if response.status_code == 400:
+                    print(f"✅ {label.capitalize()} rejected: {response.json().get('error')}")
+                else:
+                    print(f"❌ {label.capitalize()} got {response.status_code} instead of 400")
+        except Exception as e:
+            print(f"❌ Error testing region of interest: {e}")
+    
     print("\n" + "=" * 50)
     print("🎉 Server testing completed!")
     print("\n📝 Next steps:")
@@ -156,9 +383,135 @@ def test_server(base_url="http://localhost:5000"):
     print("2. Update Qt app to use the server API")
     print("3. Test with real camera images")
 
+def test_work_stealing():
+    """Idle workers must help with the subtasks of a request in progress
+    before they start the next request"""
+    from execution import WorkStealingPool
+    
+    print("\n13. Testing work stealing (in-process)...")
+    pool = WorkStealingPool('test', 2)
+    try:
+        def crowded_frame():
+            started = time.perf_counter()
+            pool.join([pool.submit(time.sleep, 0.05) for _ in range(4)])
+            return time.perf_counter() - started
+        
+        frame = pool.submit(crowded_frame)
+        time.sleep(0.01)
+        # Queued requests must not keep the idle worker from the subtasks
+        waiting = [pool.submit(time.sleep, 0.05) for _ in range(4)]
+        elapsed = frame.result()
+        pool.join(waiting)
+        stolen = pool.stats()['stolen']
+        if stolen == 0 or elapsed > 0.15:
+            print(f"❌ Subtasks were not shared: {stolen} stolen, frame took {elapsed * 1000:.0f} ms")
+        else:
+            print(f"✅ {stolen} of 4 subtasks stolen, frame took {elapsed * 1000:.0f} ms")
+    except Exception as e:
+        print(f"❌ Error testing work stealing: {e}")
+    finally:
+        pool.shutdown()
+
+def test_frame_gate():
+    """Check the unchanged-scene path of the empty-frame gate in-process;
+    over HTTP it needs a detector that can report an empty frame"""
+    import io
+    from frame_gate import FrameGate
+    
+    print("\n14. Testing unchanged-scene gate (in-process)...")
+    try:
+        def encode(image):
+            buffer = io.BytesIO()
+            image.save(buffer, format='JPEG')
+            return buffer.getvalue()
+        
+        scene = Image.new('RGB', (640, 480), color='lightblue')
+        ImageDraw.Draw(scene).rectangle([100, 300, 540, 460], fill='saddlebrown')
+        visitor = scene.copy()
+        visitor.paste(create_test_image("Visitor", (320, 320)), (160, 80))
+        # Someone far back at the edge of the view: about 5% of the frame
+        # changes, too little to move the mean over the whole thumbnail
+        distant = scene.copy()
+        ImageDraw.Draw(distant).rectangle([570, 40, 639, 250], fill=(165, 165, 165))
+        
+        gate = FrameGate(motion_threshold=3.0, max_age=60)
+        thumbnail, empty = gate.screen('kiosk', encode(scene))
+        if empty:
+            print("❌ First frame of a camera was skipped before the detector saw it")
+            return
+        gate.observe('kiosk', thumbnail, has_faces=False)
+        _, repeated = gate.screen('kiosk', encode(scene))
+        _, other_camera = gate.screen('other', encode(scene))
+        _, stepped_in = gate.screen('kiosk', encode(visitor))
+        _, at_edge = gate.screen('kiosk', encode(distant))
+        if not repeated:
+            print("❌ Unchanged empty scene was not skipped")
+        elif other_camera:
+            print("❌ Another camera's frame was skipped by this camera's reference")
+        elif stepped_in:
+            print("❌ Frame with a person in it was skipped")
+        elif at_edge:
+            print("❌ Frame with a small change at the edge was skipped")
+        else:
+            print(f"✅ Unchanged scene skipped, changed frames passed ({gate.stats()})")
+    except Exception as e:
+        print(f"❌ Error testing the frame gate: {e}")
+
+def test_live_config():
+    """Reload a changed config file in-process (the signal handlers call
+    the same reload) and check that live settings reach the app"""
+    import tempfile
+    from unittest import mock
+    
+    print("\n15. Testing live config reload (in-process)...")
+    workdir = os.getcwd()
+    scratch = tempfile.mkdtemp(prefix='face-config-test-')
+    server = config_path = None
+    # The environment is restored when the test ends
+    environment = mock.patch.dict(os.environ, {'DATABASE': os.path.join(scratch, 'test.db')})
+    try:
+        environment.start()
+        for name in ('RECOGNITION_THRESHOLD', 'INDEX_SHORTLIST_FACTOR', 'FRAME_GATE_THRESHOLD', 'PORT'):
+            os.environ.pop(name, None)
+        # The app creates its folders in the working directory
+        os.chdir(scratch)
+        import app as server
+        
+        config_path = server.config.path
+        server.config.path = os.path.join(scratch, 'config.toml')
+        with open(server.config.path, 'w') as f:
+            f.write('[server]\nport = 5999\n'
+                    '[recognition]\nthreshold = 72.5\n'
+                    '[index]\nshortlist_factor = 7\n'
+                    '[detection]\nframe_gate_threshold = 4.5\n')
+        changed = server.config.reload()
+        
+        applied = (server.RECOGNITION_THRESHOLD == 72.5 and server.gallery.shortlist_factor == 7
+                   and server.frame_gate.motion_threshold == 4.5)
+        if not applied:
+            print(f"❌ Live settings not applied: threshold {server.RECOGNITION_THRESHOLD}, "
+                  f"shortlist factor {server.gallery.shortlist_factor}, "
+                  f"frame gate threshold {server.frame_gate.motion_threshold}")
+        elif 'server.port' in changed or server.config['server.port'] == 5999:
+            print("❌ A restart-only setting (server.port) changed on reload")
+        else:
+            print(f"✅ Reloaded {', '.join(changed)}; server.port kept until restart")
+    except Exception as e:
+        print(f"❌ Error reloading config: {e}")
+    finally:
+        os.chdir(workdir)
+        environment.stop()
+        if server is not None:
+            # Put the app's own config (and its live settings) back
+            server.config.path = config_path
+            server.config.reload()
+
 if __name__ == "__main__":
     import sys
     
     # Allow custom server URL
     server_url = sys.argv[1] if len(sys.argv) > 1 else "http://localhost:5000"
-    test_server(server_url) 
\ No newline at end of file
+    test_server(server_url)
+    test_work_stealing()
+    test_frame_gate()
+    test_live_config() 
\ No newline at end of file
@@ -0,0 +1,102 @@
+"""
+Anonymized capture of API traffic for replay_traffic.py
+
+Each request becomes one JSON line with its start time, route, status,
+latency and an anonymized payload. Only the fields in CAPTURED_FIELDS are
+kept; anything else a client sends is dropped. Face images are reduced to
+their size and format, and names, emails, departments and camera ids to
+HMAC tokens under a secret key that is never written out. Tokens are
+stable for one key, so the replay tool can tell identities apart, but
+without the key they cannot be reversed by hashing a list of likely names
+or addresses. The key is the configured one, shared by every worker
+writing the capture; without one each recorder makes a random key, and
+tokens then match only within one process. No biometric data or personal
+details are written, yet the replay tool can rebuild requests with the
+same shape and cost.
+"""
+
+import hashlib
+import hmac
+import json
+import os
+import threading
+
+# Request fields that may be captured, by how they are written: 'image'
+# (dimensions, format and size), 'token' (HMAC token), 'email' (token in an
+# address shape) and 'roi' (geometry only)
+CAPTURED_FIELDS = {
+    'face_image': 'image',
+    'name': 'token',
+    'department': 'token',
+    'email': 'email',
+    'camera_id': 'token',
+    'roi': 'roi'
+}
+ROI_KEYS = ('x', 'y', 'width', 'height')
+
+
+def encoded_size(base64_string):
+    """Decoded size of a base64 payload (optionally a data URL), without
+    decoding it"""
+    if ',' in base64_string:
+        base64_string = base64_string.split(',')[1]
+    return len(base64_string) * 3 // 4 - base64_string[-2:].count('=')
+
+
+def describe_image(image, base64_string):
+    """The facts needed to rebuild a similar image: dimensions, format and
+    encoded size, from the image the handler has already opened"""
+    return {'width': image.width, 'height': image.height,
+            'format': image.format, 'bytes': encoded_size(base64_string)}
+
+
+class TrafficRecorder:
+    def __init__(self, path, key=None):
+        """`key` (str or bytes) keys the field tokens; a random key is
+        made when it is empty"""
+        self.path = path
+        self._key = (key.encode('utf-8') if isinstance(key, str) else key) or os.urandom(32)
+        self._file = open(path, 'a', buffering=1, encoding='utf-8')
+        self._lock = threading.Lock()
+
+    def _token(self, value):
+        return hmac.new(self._key, str(value).encode('utf-8'), hashlib.sha256).hexdigest()[:16]
+
+    def anonymize_payload(self, payload, image=None):
+        """Captured fields of a request body; `image` describes its face
+        image (describe_image), None when the handler could not open one"""
+        if not isinstance(payload, dict):
+            return None
+        anonymized = {}
+        for key, value in payload.items():
+            kind = CAPTURED_FIELDS.get(key)
+            if kind is None or value is None:
+                continue
+            if kind == 'image' and isinstance(value, str):
+                anonymized[key] = {'image': image or {'invalid': True, 'bytes': len(value)}}
+            elif kind == 'email':
+                anonymized[key] = f"anon-{self._token(value)}@capture.local"
+            elif kind == 'token':
+                anonymized[key] = f"anon-{self._token(value)}"
+            elif kind == 'roi' and isinstance(value, dict):
+                anonymized[key] = {name: value[name] for name in ROI_KEYS
+                                   if isinstance(value.get(name), (int, float))}
+        return anonymized
+
+    def record(self, started_at, method, route, path, query, status, latency_ms, payload, image=None):
+        line = json.dumps({
+            'ts': round(started_at, 6),
+            'method': method,
+            'route': route,
+            'path': path,
+            'query': query,
+            'status': status,
+            'latency_ms': round(latency_ms, 3),
+            'payload': self.anonymize_payload(payload, image)
+        }, ensure_ascii=False)
+        with self._lock:
+            self._file.write(line + '\n')
+
+    def close(self):
+        with self._lock:
+            self._file.close()